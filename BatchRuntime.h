@@ -0,0 +1,191 @@
+// Multithreaded evaluation of compiled Kaleidoscope functions over columns of rows
+
+#ifndef BATCHRUNTIME_H
+#define BATCHRUNTIME_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+
+/// BatchRuntime - Runs a NAME.map entry point (see -map-wrappers) over many rows
+/// on a fixed set of threads. The rows are cut into chunks small enough that a
+/// chunk's inputs and output stay in cache, and each chunk is one call to the
+/// vectorized kernel. Every thread starts with an equal share of the chunks and
+/// steals from the others once it runs out, so uneven progress still balances.
+///
+/// Chunk boundaries fall on cache line boundaries of the output buffer, so no two
+/// threads ever write to the same line.
+class BatchRuntime{
+    public:
+        /// MapFunction - Signature of the NAME.map entry points:
+        /// Out[i] = NAME(Columns[0][i], Columns[1][i], ...) for every i < N.
+        typedef void (*MapFunction)(const double* const* Columns, double* Out, uint64_t N);
+
+    private:
+        static constexpr size_t CacheLineSize = 64;
+        static constexpr uint64_t RowsPerLine = CacheLineSize / sizeof(double);
+
+        /// TargetChunkBytes - How much input and output one chunk touches, sized to
+        /// stay in a core's L1 data cache.
+        static constexpr uint64_t TargetChunkBytes = 32 * 1024;
+
+        /// WorkQueue - The chunks [Next, End) one thread started the job with. The
+        /// owner and thieves alike claim a chunk by bumping Next, so every chunk is
+        /// run exactly once. Each queue has a cache line to itself so claiming a
+        /// chunk never slows down another thread's claims.
+        struct alignas(CacheLineSize) WorkQueue{
+            std::atomic<uint64_t> Next{0};
+            uint64_t End = 0;
+        };
+
+        std::vector<std::thread> Threads;
+        std::unique_ptr<WorkQueue[]> Queues; // One per thread, the last is the caller's.
+        unsigned NumQueues;
+
+        // The job being run, only changed while every thread is idle.
+        MapFunction Fn = nullptr;
+        llvm::ArrayRef<const double*> Columns;
+        double* Out = nullptr;
+        uint64_t NumRows = 0;
+        uint64_t LeadRows = 0;  // Rows before the first cache line boundary of Out.
+        uint64_t ChunkRows = 0;
+
+        std::mutex Lock;
+        std::condition_variable WorkReady;
+        std::condition_variable WorkDone;
+        uint64_t Generation = 0;
+        unsigned Busy = 0;
+        bool ShuttingDown = false;
+
+        /// getChunkBegin - First row of chunk C. Every chunk but the first starts on a
+        /// cache line of Out; the first also takes the rows before that line.
+        uint64_t getChunkBegin(uint64_t C) const{
+            if(C == 0)
+                return 0;
+            return std::min(NumRows, LeadRows + C * ChunkRows);
+        }
+
+        void runChunk(uint64_t C){
+            uint64_t Begin = getChunkBegin(C);
+            uint64_t End = getChunkBegin(C + 1);
+            if(Begin == End)
+                return;
+
+            llvm::SmallVector<const double*, 8> ChunkColumns;
+            for(const double* Column : Columns)
+                ChunkColumns.push_back(Column + Begin);
+            Fn(ChunkColumns.data(), Out + Begin, End - Begin);
+        }
+
+        /// runQueues - Drain this thread's own queue, then help with everyone else's.
+        void runQueues(unsigned Self){
+            for(unsigned I = 0; I != NumQueues; ++I){
+                WorkQueue& Q = Queues[(Self + I) % NumQueues];
+                while(true){
+                    uint64_t C = Q.Next.fetch_add(1, std::memory_order_relaxed);
+                    if(C >= Q.End)
+                        break;
+                    runChunk(C);
+                }
+            }
+        }
+
+        void workerLoop(unsigned Self){
+            uint64_t Seen = 0;
+            while(true){
+                {
+                    std::unique_lock<std::mutex> Guard(Lock);
+                    WorkReady.wait(Guard, [&](){ return ShuttingDown || Generation != Seen; });
+                    if(ShuttingDown)
+                        return;
+                    Seen = Generation;
+                }
+
+                runQueues(Self);
+
+                std::lock_guard<std::mutex> Guard(Lock);
+                if(--Busy == 0)
+                    WorkDone.notify_one();
+            }
+        }
+
+    public:
+        /// BatchRuntime - Start NumThreads threads in total, counting the thread that
+        /// calls run(). 0 means one per hardware thread.
+        explicit BatchRuntime(unsigned NumThreads = 0){
+            if(NumThreads == 0)
+                NumThreads = std::max(1u, std::thread::hardware_concurrency());
+
+            NumQueues = NumThreads;
+            Queues.reset(new WorkQueue[NumQueues]);
+            for(unsigned I = 0; I + 1 < NumThreads; ++I)
+                Threads.emplace_back([this, I](){ workerLoop(I); });
+        }
+
+        BatchRuntime(const BatchRuntime&) = delete;
+        BatchRuntime& operator=(const BatchRuntime&) = delete;
+
+        ~BatchRuntime(){
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                ShuttingDown = true;
+            }
+            WorkReady.notify_all();
+            for(auto& T : Threads)
+                T.join();
+        }
+
+        unsigned getThreadCount() const {return NumQueues;}
+
+        /// run - Set Out[i] = F(Cols[0][i], Cols[1][i], ...) for every i < N, where F
+        /// is the function Map was generated for. Returns once every row is done.
+        /// The caller's thread takes part, so run() must not be called concurrently.
+        void run(MapFunction Map, llvm::ArrayRef<const double*> Cols, double* Output, uint64_t N,
+                 uint64_t RowsPerChunk = 0){
+            if(N == 0)
+                return;
+
+            if(RowsPerChunk == 0)
+                RowsPerChunk = TargetChunkBytes / ((Cols.size() + 1) * sizeof(double));
+            RowsPerChunk = std::max(RowsPerLine, RowsPerChunk / RowsPerLine * RowsPerLine);
+
+            uint64_t Misalign = reinterpret_cast<uintptr_t>(Output) % CacheLineSize;
+            uint64_t Lead = Misalign ? (CacheLineSize - Misalign) / sizeof(double) : 0;
+            uint64_t NumChunks = N <= Lead ? 1 : std::max<uint64_t>(1, (N - Lead + RowsPerChunk - 1) / RowsPerChunk);
+
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                Fn = Map;
+                Columns = Cols;
+                Out = Output;
+                NumRows = N;
+                LeadRows = std::min(Lead, N);
+                ChunkRows = RowsPerChunk;
+
+                // Hand every queue an equal, contiguous share of the chunks.
+                for(unsigned I = 0; I != NumQueues; ++I){
+                    Queues[I].Next.store(NumChunks * I / NumQueues, std::memory_order_relaxed);
+                    Queues[I].End = NumChunks * (I + 1) / NumQueues;
+                }
+
+                ++Generation;
+                Busy = Threads.size();
+            }
+            WorkReady.notify_all();
+
+            runQueues(NumQueues - 1);
+
+            std::unique_lock<std::mutex> Guard(Lock);
+            WorkDone.wait(Guard, [&](){ return Busy == 0; });
+        }
+};
+
+#endif // BATCHRUNTIME_H
@@ -1,26 +1,381 @@
 // Driver for LLVM tutorial
 
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cmath>
+#include <charconv>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <string>
-#include <map>
+#include <thread>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/APSInt.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
+#include "BatchRuntime.h"
+#include "KaleidoscopeEngine.h"
+#include "KaleidoscopeJIT.h"
+#include "KaleidoscopeLibrary.h"
+#include "SPSCQueue.h"
 
 using namespace llvm;
+using namespace llvm::orc;
+
+#define DEBUG_TYPE "kaleidoscope"
+
+//------------------------------------------------------------------------------------------------------//
+// Command line options
+//------------------------------------------------------------------------------------------------------//
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::desc("<input files>"));
+
+static cl::opt<bool> CompileOnly("c", cl::desc("Compile the inputs to a single output file instead of running them"));
+
+enum OutputFileType { OFT_Object, OFT_Bitcode, OFT_Library };
+
+static cl::opt<OutputFileType> FileType("filetype", cl::desc("Kind of file written with -c (default = obj)"),
+                                        cl::init(OFT_Object),
+                                        cl::values(clEnumValN(OFT_Object, "obj", "Native object file"),
+                                                   clEnumValN(OFT_Bitcode, "bc", "LLVM bitcode file"),
+                                                   clEnumValN(OFT_Library, "lib", "Kaleidoscope library for -l")));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename for -c"), cl::value_desc("filename"));
+
+static cl::list<std::string> LibraryFiles("l", cl::desc("Make the functions of a library written with -c -filetype=lib "
+                                                        "callable, reading each one only when it is first used"),
+                                          cl::value_desc("library"), cl::Prefix, cl::ZeroOrMore);
+
+static cl::opt<char> OptLevel("O", cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+                              cl::Prefix, cl::ZeroOrMore, cl::init('2'));
+
+enum FastMathFlag { fmf_reassoc, fmf_contract, fmf_nnan, fmf_ninf, fmf_nsz, fmf_arcp, fmf_afn, fmf_fast };
+
+static cl::bits<FastMathFlag> FastMath("fast-math", cl::desc("Let floating point operations ignore IEEE semantics in "
+                                                             "these ways (default = none)"),
+                                       cl::CommaSeparated,
+                                       cl::values(clEnumValN(fmf_reassoc, "reassoc", "Reassociate operations"),
+                                                  clEnumValN(fmf_contract, "contract", "Fuse multiplies and adds"),
+                                                  clEnumValN(fmf_nnan, "nnan", "Assume no NaNs"),
+                                                  clEnumValN(fmf_ninf, "ninf", "Assume no infinities"),
+                                                  clEnumValN(fmf_nsz, "nsz", "Ignore the sign of zeros"),
+                                                  clEnumValN(fmf_arcp, "arcp", "Multiply by reciprocals"),
+                                                  clEnumValN(fmf_afn, "afn", "Approximate math functions"),
+                                                  clEnumValN(fmf_fast, "fast", "All of the above")));
+
+static cl::list<std::string> FastMathFunctions("fast-math-functions", cl::desc("Only use the -fast-math flags in "
+                                                                               "these definitions (default = all)"),
+                                               cl::CommaSeparated, cl::value_desc("name"));
+
+static cl::opt<std::string> TargetCPU("mcpu", cl::desc("CPU to compile for with -c, 'native' for the host's CPU and "
+                                                       "features (default = generic)"),
+                                      cl::value_desc("cpu"), cl::init("generic"));
+
+static cl::opt<bool> InterproceduralOpt("ipo", cl::desc("With -c, optimize all definitions together before writing "
+                                                        "the output: inlining, IPSCCP, attribute inference and "
+                                                        "dead function elimination (default = true). Libraries "
+                                                        "are left alone, so their functions can be redefined"),
+                                        cl::init(true));
+
+static cl::opt<unsigned> NumThreads("j", cl::desc("Parse the inputs up front and compile their definitions on this "
+                                                  "many threads (0 = one per core, default = 1). The top-level "
+                                                  "expressions run in order once every definition is compiled, "
+                                                  "so a function can't be defined twice"),
+                                    cl::Prefix, cl::init(1));
+
+static cl::opt<bool> Pipeline("pipeline", cl::desc("Lex and parse on a thread of their own, overlapping with code "
+                                               "generation and execution on the main thread"));
+
+static cl::opt<bool> LazyCompile("lazy", cl::desc("Only compile a JIT'd function the first time it is called "
+                                                  "(default = true)"),
+                                 cl::init(true));
+
+static cl::opt<bool> Tiered("tiered", cl::desc("Compile definitions quickly, unoptimized and counting calls and "
+                                              "branches, and recompile each one at -O3 for its profile in the "
+                                              "background once it has been called -tier-up-calls times"));
+
+static cl::opt<unsigned> TierUpCalls("tier-up-calls", cl::desc("Calls after which -tiered recompiles a definition "
+                                                               "(default = 1000)"),
+                                     cl::init(1000));
+
+static cl::opt<bool> DiscardValueNames("discard-value-names", cl::desc("Leave the values in the generated IR unnamed, "
+                                                                      "which saves naming and uniquing them"));
+
+static cl::opt<unsigned> ContextModules("context-modules", cl::desc("Modules the JIT is handed from one LLVMContext "
+                                                                  "before code generation moves on to a new one, so "
+                                                                  "the types and constants of the old one are freed "
+                                                                  "with its last module; 0 never moves on "
+                                                                  "(default = 64)"),
+                                      cl::init(64));
+
+static cl::opt<bool> PrintMemoryStats("memory-stats", cl::desc("Print how much memory the AST, the JIT's code and "
+                                                               "data, and the heap as a whole take up at the end"));
+
+static cl::opt<bool> Memoize("memoize", cl::desc("Put a cache of recent results in front of every definition that "
+                                                "only computes with its arguments, and reuse the results of "
+                                                "top-level expressions evaluated before"));
+
+static cl::opt<unsigned> MemoizeEntries("memoize-entries", cl::desc("Entries in each -memoize cache, rounded up to a "
+                                                                    "power of two (default = 256)"),
+                                        cl::init(256));
+
+static cl::opt<bool> EmitMapWrappers("map-wrappers", cl::desc("Also emit a vectorized NAME.map batch entry point "
+                                                            "for every definition"));
+
+static cl::opt<std::string> CacheDir("cache-dir", cl::desc("Directory of compiled definitions the JIT reuses across runs"),
+                                     cl::value_desc("directory"));
+
+enum BenchmarkWorkload { bench_none, bench_wide, bench_nested, bench_chain, bench_calls, bench_all };
+
+static cl::opt<BenchmarkWorkload> Benchmark("benchmark", cl::desc("Time the lexer, parser, code generator and JIT on a "
+                                                                  "generated input instead of compiling the inputs"),
+                                            cl::init(bench_none),
+                                            cl::values(clEnumValN(bench_wide, "wide", "Many small definitions"),
+                                                       clEnumValN(bench_nested, "nested", "One deeply nested expression"),
+                                                       clEnumValN(bench_chain, "chain", "One long chain of operators"),
+                                                       clEnumValN(bench_calls, "calls", "Definitions made of calls to "
+                                                                                        "user defined operators"),
+                                                       clEnumValN(bench_all, "all", "Each of the above in turn")));
+
+static cl::opt<unsigned> BenchmarkSize("benchmark-size", cl::desc("Size of the -benchmark input: definitions for wide "
+                                                                  "and calls, depth for nested, operators for chain "
+                                                                  "(default = 10000)"),
+                                       cl::init(10000));
+
+static cl::opt<unsigned> BenchmarkRepetitions("benchmark-repetitions", cl::desc("Runs of each -benchmark measurement, "
+                                                                                "the fastest is reported (default = 5)"),
+                                              cl::init(5));
+
+static cl::opt<bool> TimePhases("time-phases", cl::desc("Time each phase of compilation and each optimization pass, "
+                                                        "and count what was compiled; print a report on exit. With "
+                                                        "-j only the main thread is timed"));
+
+static cl::opt<bool> TimeTrace("time-trace", cl::desc("Record the phases and passes of every thread as a Chrome "
+                                                      "trace (chrome://tracing) in -time-trace-file"));
+
+static cl::opt<std::string> TimeTraceFile("time-trace-file", cl::desc("Where -time-trace writes its trace "
+                                                                      "(default = kaleidoscope.time-trace.json)"),
+                                          cl::value_desc("filename"), cl::init("kaleidoscope.time-trace.json"));
+
+static cl::opt<unsigned> TimeTraceGranularity("time-trace-granularity",
+                                              cl::desc("Shortest event, in microseconds, -time-trace records "
+                                                       "(default = 500)"),
+                                              cl::init(500));
+
+//------------------------------------------------------------------------------------------------------//
+// End of command line options
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Instrumentation
+//------------------------------------------------------------------------------------------------------//
+
+ALWAYS_ENABLED_STATISTIC(NumTokens, "Number of tokens read by the parser");
+ALWAYS_ENABLED_STATISTIC(NumASTNodes, "Number of expression nodes parsed");
+ALWAYS_ENABLED_STATISTIC(NumFunctions, "Number of IR functions generated");
+ALWAYS_ENABLED_STATISTIC(NumInstructions, "Number of IR instructions left after function optimization");
+ALWAYS_ENABLED_STATISTIC(NumCacheHits, "Number of definitions loaded from the object cache");
+ALWAYS_ENABLED_STATISTIC(NumCacheMisses, "Number of definitions compiled for the object cache");
+ALWAYS_ENABLED_STATISTIC(NumEvaluated, "Number of top-level expressions run");
+ALWAYS_ENABLED_STATISTIC(NumLibraryFunctions, "Number of functions declared from libraries");
+ALWAYS_ENABLED_STATISTIC(NumLibraryDefinitionsKept, "Number of definitions left to the library compiled from them");
+ALWAYS_ENABLED_STATISTIC(NumMemoized, "Number of definitions -memoize put a result cache in front of");
+ALWAYS_ENABLED_STATISTIC(NumResultsReused, "Number of top-level expressions -memoize had the result of");
+ALWAYS_ENABLED_STATISTIC(NumTierUps, "Number of definitions -tiered recompiled for their profile");
+ALWAYS_ENABLED_STATISTIC(NumContexts, "Number of LLVMContexts code was generated in");
+
+/// Phase - The parts of the work -time-phases and -time-trace tell apart. Every
+/// moment of a run is charged to at most one of them.
+enum Phase {
+    phase_parse,
+    phase_irgen,
+    phase_verify,
+    phase_optimize,
+    phase_codegen,
+    phase_execute,
+    num_phases
+};
+
+static const char* const PhaseNames[num_phases][2] = {
+    {"parse", "Lexing and parsing"},
+    {"irgen", "IR generation"},
+    {"verify", "IR verification"},
+    {"optimize", "IR optimization"},
+    {"codegen", "Native code generation"},
+    {"execute", "Execution (including lazy compilation)"}
+};
+
+/// PhaseTimers - The -time-phases timer for each phase. Each timer must only ever
+/// be run by one thread, though not every timer by the same one: -pipeline runs
+/// the parse timer on its parser thread and the others on the main thread.
+class PhaseTimers{
+    private:
+        TimerGroup Group;
+        Timer Timers[num_phases];
+
+    public:
+        PhaseTimers() : Group("kaleidoscope", "Kaleidoscope phase timing report"){
+            for(unsigned P = 0; P != num_phases; ++P)
+                Timers[P].init(PhaseNames[P][0], PhaseNames[P][1], Group);
+        }
+
+        Timer& get(Phase P) {return Timers[P];}
+
+        /// print - Report the time taken by each phase so far, and start over.
+        void print(raw_ostream& OS) {Group.print(OS, /*ResetAfterPrint*/ true);}
+};
+
+/// PhaseScope - Charge the work done while the scope lasts to a phase: to its
+/// timer when given PhaseTimers, and to the current thread's -time-trace profile
+/// when that is on. switchTo moves on to another phase without any gap or overlap.
+class PhaseScope{
+    private:
+        PhaseTimers* Timers;
+        StringRef Detail;   // Shown with each trace event, e.g. the function's name.
+        Timer* Running = nullptr;
+        bool Tracing = false;
+
+        void begin(Phase P){
+            if(Timers){
+                Running = &Timers->get(P);
+                Running->startTimer();
+            }
+            if(timeTraceProfilerEnabled()){
+                timeTraceProfilerBegin(PhaseNames[P][1], Detail);
+                Tracing = true;
+            }
+        }
+
+    public:
+        PhaseScope(PhaseTimers* Timers, Phase P, StringRef Detail = "") : Timers(Timers), Detail(Detail){
+            begin(P);
+        }
+        PhaseScope(const PhaseScope&) = delete;
+        PhaseScope& operator=(const PhaseScope&) = delete;
+        ~PhaseScope() {finish();}
+
+        void switchTo(Phase P){
+            finish();
+            begin(P);
+        }
+
+        /// finish - End the phase before the scope does.
+        void finish(){
+            if(Running)
+                Running->stopTimer();
+            Running = nullptr;
+            if(Tracing)
+                timeTraceProfilerEnd();
+            Tracing = false;
+        }
+};
+
+/// registerTimeTraceCallbacks - Record every pass run through PIC in the -time-trace
+/// profile of the thread running it.
+static void registerTimeTraceCallbacks(PassInstrumentationCallbacks& PIC){
+    PIC.registerBeforeNonSkippedPassCallback([](StringRef PassID, Any IR){
+        StringRef Detail;
+        if(any_isa<const Function*>(IR))
+            Detail = any_cast<const Function*>(IR)->getName();
+        timeTraceProfilerBegin(PassID, Detail);
+    });
+    PIC.registerAfterPassCallback([](StringRef, Any, const PreservedAnalyses&){
+        timeTraceProfilerEnd();
+    });
+    PIC.registerAfterPassInvalidatedCallback([](StringRef, const PreservedAnalyses&){
+        timeTraceProfilerEnd();
+    });
+}
+
+/// ThreadTraceScope - Give a worker thread a -time-trace profile of its own for
+/// as long as the scope lasts, then merge it into the main thread's.
+class ThreadTraceScope{
+    public:
+        ThreadTraceScope(){
+            if(TimeTrace)
+                timeTraceProfilerInitialize(TimeTraceGranularity, "kaleidoscope");
+        }
+        ~ThreadTraceScope(){
+            if(TimeTrace)
+                timeTraceProfilerFinishThread();
+        }
+};
+
+//------------------------------------------------------------------------------------------------------//
+// End of instrumentation
+//------------------------------------------------------------------------------------------------------//
 
 //------------------------------------------------------------------------------------------------------//
 // Lexer
@@ -37,16 +392,273 @@ enum Token {
 
     // primary
     tok_identifier = -4,
-    tok_number = -5
+    tok_number = -5,
+
+    // operators
+    tok_binary = -6,
+    tok_unary = -7,
+
+    // control
+    tok_if = -8,
+    tok_then = -9,
+    tok_else = -10,
+    tok_for = -11,
+    tok_in = -12,
+
+    // var definition
+    tok_var = -13
+};
+
+/// SymbolID - Stable handle for an interned identifier. Equal names always get the
+/// same ID, so the parser and code generator compare and hash integers, not strings.
+typedef unsigned SymbolID;
+
+/// Symbols the lexer and driver need to recognise are interned up front in this
+/// order, so checking for a keyword is an integer compare. sym_none is the empty
+/// name and doubles as "no symbol".
+enum PredefinedSymbol : SymbolID {
+    sym_none = 0,
+    sym_def,
+    sym_extern,
+    sym_binary,
+    sym_unary,
+    sym_if,
+    sym_then,
+    sym_else,
+    sym_for,
+    sym_in,
+    sym_var,
+    sym_anon_expr
+};
+
+/// SymbolTable - Interns identifiers. Each distinct name is copied once into the
+/// table and lives as long as the table does.
+///
+/// Only one thread may intern names, but others may look up the names of IDs that
+/// were handed to them (see -pipeline) while it does. So the names are kept in
+/// segments that never move: the first holds FirstSegmentSize names and every
+/// later one twice as many as the one before.
+class SymbolTable{
+    private:
+        static constexpr unsigned FirstSegmentBits = 6;
+        static constexpr SymbolID FirstSegmentSize = 1 << FirstSegmentBits;
+        static constexpr unsigned NumSegments = 33 - FirstSegmentBits;
+
+        StringMap<SymbolID> IDs;
+        std::unique_ptr<StringRef[]> Segments[NumSegments];
+        SymbolID NumNames = 0;
+
+        /// getSegment - The segment holding ID, and ID's index within it.
+        static unsigned getSegment(SymbolID ID, SymbolID& Idx){
+            unsigned Segment = Log2_64((uint64_t)ID / FirstSegmentSize + 1);
+            Idx = ID - FirstSegmentSize * ((SymbolID(1) << Segment) - 1);
+            return Segment;
+        }
+
+    public:
+        SymbolTable(){
+            intern("");
+            intern("def");
+            intern("extern");
+            intern("binary");
+            intern("unary");
+            intern("if");
+            intern("then");
+            intern("else");
+            intern("for");
+            intern("in");
+            intern("var");
+            intern("__anon_expr");
+        }
+
+        SymbolID intern(StringRef Name){
+            auto Ins = IDs.try_emplace(Name, NumNames);
+            if(Ins.second){
+                SymbolID Idx;
+                unsigned Segment = getSegment(NumNames++, Idx);
+                if(!Segments[Segment])
+                    Segments[Segment].reset(new StringRef[size_t(FirstSegmentSize) << Segment]);
+                Segments[Segment][Idx] = Ins.first->getKey();
+            }
+            return Ins.first->second;
+        }
+
+        /// find - The ID of Name if it has been interned, or sym_none. Several threads
+        /// may find names at once, but not while one interns, which may rehash the
+        /// map. Only getName is safe alongside intern. The engine's lookups hold its
+        /// lock shared, which keeps compile, and so intern, out.
+        SymbolID find(StringRef Name) const{
+            auto I = IDs.find(Name);
+            return I == IDs.end() ? sym_none : I->second;
+        }
+
+        StringRef getName(SymbolID ID) const{
+            SymbolID Idx;
+            unsigned Segment = getSegment(ID, Idx);
+            return Segments[Segment][Idx];
+        }
+};
+
+/// getIdentifierToken - The keyword token for an interned identifier, or
+/// tok_identifier if it isn't a keyword.
+static int getIdentifierToken(SymbolID Sym){
+    switch(Sym){
+        case sym_def:
+            return tok_def;
+        case sym_extern:
+            return tok_extern;
+        case sym_binary:
+            return tok_binary;
+        case sym_unary:
+            return tok_unary;
+        case sym_if:
+            return tok_if;
+        case sym_then:
+            return tok_then;
+        case sym_else:
+            return tok_else;
+        case sym_for:
+            return tok_for;
+        case sym_in:
+            return tok_in;
+        case sym_var:
+            return tok_var;
+        default:
+            return tok_identifier;
+    }
+}
+
+/// Lexer - Turns the input into tokens, interning identifiers into the session's
+/// symbol table as they are scanned.
+class Lexer{
+    private:
+        SymbolTable& Symbols;
+
+        /// SourceBuffer - The whole input when it comes from a file or redirected stdin.
+        /// CurPtr is the buffered lexer's position in it. When there is no buffer the
+        /// lexer reads stdin a character at a time so the REPL stays interactive.
+        std::unique_ptr<MemoryBuffer> SourceBuffer;
+        const char* CurPtr = nullptr;
+        const char* BufferEnd = nullptr;
+
+        // State of the getchar() path.
+        int LastChar = ' ';
+        std::string IdentifierBuf;
+
+        int gettokFromBuffer();
+        int gettokFromStdin();
+
+    public:
+        SymbolID IdentifierSym;     // Filled in if tok_identifier
+        double NumVal;              // Filled in if tok_number
+
+        explicit Lexer(SymbolTable& Symbols) : Symbols(Symbols) {}
+
+        bool openSource(StringRef Filename);
+        void openBuffer(std::unique_ptr<MemoryBuffer> Buffer);
+
+        // gettok - Return the next token from the input.
+        int gettok(){
+            if(SourceBuffer)
+                return gettokFromBuffer();
+            return gettokFromStdin();
+        }
 };
 
-static std::string IdentifierStr;  // Filled in if tok_identifier
-static double NumVal;              // Filled in if tok_number
+/// openSource - Pick the input for the lexer. Files are memory mapped and a
+/// redirected stdin is read in large chunks; a terminal keeps using getchar().
+bool Lexer::openSource(StringRef Filename){
+    if(Filename == "-" && sys::Process::StandardInIsUserInput()){
+        SourceBuffer.reset();
+        return true;
+    }
+
+    auto BufOrErr = MemoryBuffer::getFileOrSTDIN(Filename);
+    if(!BufOrErr){
+        std::cerr << "Error: could not open " << Filename.str() << ": " << BufOrErr.getError().message() << std::endl;
+        return false;
+    }
+
+    openBuffer(std::move(*BufOrErr));
+    return true;
+}
+
+/// openBuffer - Lex source that is already in memory.
+void Lexer::openBuffer(std::unique_ptr<MemoryBuffer> Buffer){
+    SourceBuffer = std::move(Buffer);
+    CurPtr = SourceBuffer->getBufferStart();
+    BufferEnd = SourceBuffer->getBufferEnd();
+}
+
+// gettokFromBuffer - Return the next token from SourceBuffer. Tokens are scanned
+// in place: identifiers are interned straight from the buffer and numbers are
+// converted without being copied out first.
+int Lexer::gettokFromBuffer(){
+    const char* Ptr = CurPtr;
+
+    while(true){
+        // Skip any whitespace.
+        while(Ptr != BufferEnd && isSpace(*Ptr))
+            ++Ptr;
+
+        if(Ptr == BufferEnd || *Ptr != '#')
+            break;
+
+        // Comment until end of line.
+        while(Ptr != BufferEnd && *Ptr != '\n' && *Ptr != '\r')
+            ++Ptr;
+    }
+
+    // Check for end of file. Don't eat the EOF.
+    if(Ptr == BufferEnd){
+        CurPtr = Ptr;
+        return tok_eof;
+    }
+
+    const char* TokStart = Ptr;
+
+    // Identifiers must start with a letter.
+    if(isAlpha(*Ptr)){ // identifier: [a-zA-Z][a-zA-Z0-9]*
+        do
+            ++Ptr;
+        while(Ptr != BufferEnd && isAlnum(*Ptr));
+
+        CurPtr = Ptr;
+        IdentifierSym = Symbols.intern(StringRef(TokStart, Ptr - TokStart));
+        return getIdentifierToken(IdentifierSym);
+    }
+
+    // Numbers may start with either a number or a decimal point, with the same
+    // check for improperly formated numbers as the getchar() path.
+    if(isDigit(*Ptr) || *Ptr == '.'){ // Number: [0-9.]+
+        bool hasDecimal = false;
+        bool decimalError = false;
+        do{
+            if(*Ptr == '.' && hasDecimal)
+                decimalError = true;
+            if(*Ptr == '.')
+                hasDecimal = true;
+            ++Ptr;
+        } while(Ptr != BufferEnd && (isDigit(*Ptr) || *Ptr == '.'));
+
+        CurPtr = Ptr;
+        // Like strtod, a lone '.' reads as zero.
+        NumVal = 0;
+        std::from_chars(TokStart, Ptr, NumVal);
+        if(decimalError){
+            std::cerr << "Number Syntax Error! Too many decimals: " << NumVal << std::endl;
+            exit(1);
+        }
+        return tok_number;
+    }
 
-// gettok - Return the next token from standard input.
-static int gettok(){
-    static int LastChar = ' ';
+    // Otherwise, just return the character as its ascii value.
+    CurPtr = Ptr + 1;
+    return (unsigned char)*Ptr;
+}
 
+// gettokFromStdin - Return the next token from standard input.
+int Lexer::gettokFromStdin(){
     // Skip any whitespace.
     while(isspace(LastChar)){
         LastChar = getchar();
@@ -54,15 +666,12 @@ static int gettok(){
 
     // Identifiers must start with a letter.
     if(isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-        IdentifierStr = LastChar;
+        IdentifierBuf = LastChar;
         while(isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
+            IdentifierBuf += LastChar;
 
-        if(IdentifierStr == "def")
-            return tok_def;
-        if( IdentifierStr == "extern")
-            return tok_extern;
-        return tok_identifier;
+        IdentifierSym = Symbols.intern(IdentifierBuf);
+        return getIdentifierToken(IdentifierSym);
     }
 
     // Numbers may start with either a number or a decimal point
@@ -97,7 +706,7 @@ static int gettok(){
         while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if(LastChar != EOF)
-            return gettok();
+            return gettokFromStdin();
     }
 
     // Check for end of file. Don't eat the EOF.
@@ -108,7 +717,7 @@ static int gettok(){
     int ThisChar = LastChar;
     LastChar = getchar();
     return ThisChar;
-} // end of gettok()
+} // end of gettokFromStdin()
 
 //------------------------------------------------------------------------------------------------------//
 // End of Lexer
@@ -118,12 +727,77 @@ static int gettok(){
 // Abstract Syntax Tree (aka Parse Tree)
 //------------------------------------------------------------------------------------------------------//
 
+class CodeGen;
+struct HashContext;
+
+/// isBuiltinBinaryOp - The operators BinaryExprAST::codegen emits inline. These
+/// take precedence over a user definition for the same character.
+static bool isBuiltinBinaryOp(char Op){
+    return Op == '+' || Op == '-' || Op == '*' || Op == '/' || Op == '<';
+}
+
 namespace{
-    /// ExprAST - Base class for all expression nodes.
+    /// ExprAST - Base class for all expression nodes. Nodes live in the parser's
+    /// arena, which is released as a whole, so they are never destroyed one at a
+    /// time and must not own heap memory.
     class ExprAST{
         public:
+            /// ExprKind - Discriminator for LLVM-style isa<>/dyn_cast<>.
+            enum ExprKind{
+                EK_Number,
+                EK_Variable,
+                EK_Unary,
+                EK_Binary,
+                EK_Call,
+                EK_If,
+                EK_For,
+                EK_Var,
+                EK_Assign
+            };
+
+            /// EmitState - What a node keeps between emitting one operand and the
+            /// next, such as the blocks it branches between or the variables it binds.
+            struct EmitState{
+                BasicBlock* Blocks[3] = {};
+                AllocaInst* Slot = nullptr;
+                size_t ScopeMark = 0;   // CodeGen::Shadowed size before the node bound anything.
+            };
+
+        private:
+            const ExprKind Kind;
+            const bool Pure;
+
+        public:
+            ExprAST(ExprKind Kind, bool Pure) : Kind(Kind), Pure(Pure) {}
             virtual ~ExprAST() = default;
-            virtual Value* codegen() = 0;
+            ExprKind getKind() const {return Kind;}
+
+            /// isPure - Evaluating the expression has no effect besides producing its
+            /// value: it only calls definitions that are pure themselves.
+            bool isPure() const {return Pure;}
+
+            /// getOperands - The subexpressions this node's value is computed from, in
+            /// evaluation order.
+            virtual ArrayRef<ExprAST*> getOperands() const {return None;}
+
+            /// codegen - Emit the whole expression. The tree is walked with an explicit
+            /// stack, so how deeply it nests doesn't matter.
+            Value* codegen(CodeGen& CG);
+            /// beginOperand - Called before operand Idx is emitted, with the values of
+            /// the operands before it. Control flow nodes start the operand's block
+            /// here. Returns false on error.
+            virtual bool beginOperand(CodeGen& /*CG*/, unsigned /*Idx*/, ArrayRef<Value*> /*Done*/,
+                                      EmitState& /*State*/){
+                return true;
+            }
+            /// emit - Emit this node alone, given the values of its operands.
+            virtual Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) = 0;
+
+            /// addToHash - Feed everything that affects the generated code into Hash,
+            /// with names spelled out so the result is the same in every run.
+            void addToHash(MD5& Hash, const HashContext& Ctx) const;
+            /// hashNode - Feed this node alone into Hash, without its operands.
+            virtual void hashNode(MD5& Hash, const HashContext& Ctx) const = 0;
     };
 
     /// NumberExprAST - Expression class for numeric literals like "1.0"
@@ -132,74 +806,243 @@ namespace{
             double Val;
 
         public:
-            NumberExprAST(double Val) : Val(Val) {}
-            Value* codegen() override;
+            NumberExprAST(double Val) : ExprAST(EK_Number, true), Val(Val) {}
+            double getVal() const {return Val;}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Number;}
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
     };
 
     /// VariableExprAST - Expression class for referencing a variable, like "a".
     class VariableExprAST : public ExprAST{
         private:
-            std::string Name;
+            SymbolID Name;
+
+        public:
+            VariableExprAST(SymbolID Name) : ExprAST(EK_Variable, true), Name(Name) {}
+            SymbolID getName() const {return Name;}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Variable;}
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
+    };
+
+    /// UnaryExprAST - Expression class for a user defined unary operator, which is
+    /// a call to the function Fn implementing it.
+    class UnaryExprAST : public ExprAST{
+        private:
+            char Opcode;
+            SymbolID Fn;
+            ExprAST* Operand;
 
         public:
-            VariableExprAST(const std::string& Name) : Name(Name) {}
-            Value* codegen() override;
+            UnaryExprAST(char Opcode, SymbolID Fn, ExprAST* Operand, bool Pure)
+                : ExprAST(EK_Unary, Pure), Opcode(Opcode), Fn(Fn), Operand(Operand) {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Unary;}
+            ArrayRef<ExprAST*> getOperands() const override {return makeArrayRef(Operand);}
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
     };
 
-    /// BinaryExprAST - Expression class for a binary operator.
+    /// BinaryExprAST - Expression class for a binary operator. Fn is the function
+    /// implementing a user defined operator, or sym_none for the builtin ones.
     class BinaryExprAST : public ExprAST{
         private:
             char Op;
-            std::unique_ptr<ExprAST> LHS, RHS;
+            SymbolID Fn;
+            ExprAST* Ops[2];    // LHS, RHS
 
         public:
-            BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-                : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-            Value* codegen() override;
-
+            BinaryExprAST(char Op, SymbolID Fn, ExprAST* LHS, ExprAST* RHS, bool Pure)
+                : ExprAST(EK_Binary, Pure), Op(Op), Fn(Fn), Ops{LHS, RHS} {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Binary;}
+            ArrayRef<ExprAST*> getOperands() const override {return Ops;}
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
     };
 
     /// CallExprAST - Expression class for function calls.
     class CallExprAST : public ExprAST {
         private:
-            std::string Callee;
-            std::vector<std::unique_ptr<ExprAST> > Args;
+            SymbolID Callee;
+            ArrayRef<ExprAST*> Args;
+
+        public:
+            CallExprAST(SymbolID Callee, ArrayRef<ExprAST*> Args, bool Pure)
+                : ExprAST(EK_Call, Pure), Callee(Callee), Args(Args) {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Call;}
+            ArrayRef<ExprAST*> getOperands() const override {return Args;}
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
+    };
+
+    /// IfExprAST - Expression class for if/then/else.
+    class IfExprAST : public ExprAST{
+        private:
+            ExprAST* Ops[3];    // Cond, Then, Else
+
+        public:
+            IfExprAST(ExprAST* Cond, ExprAST* Then, ExprAST* Else, bool Pure)
+                : ExprAST(EK_If, Pure), Ops{Cond, Then, Else} {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_If;}
+            ArrayRef<ExprAST*> getOperands() const override {return Ops;}
+            bool beginOperand(CodeGen& CG, unsigned Idx, ArrayRef<Value*> Done, EmitState& State) override;
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
+    };
+
+    /// ForExprAST - Expression class for for/in. The operands are in the order they
+    /// are evaluated: Start once, then Body, Step (if there is one) and End on every
+    /// iteration.
+    class ForExprAST : public ExprAST{
+        private:
+            SymbolID VarName;
+            ValueType VarType;
+            ExprAST* Ops[4];    // Start, Body, Step, End; or Start, Body, End
+            unsigned NumOps;
+
+        public:
+            ForExprAST(SymbolID VarName, ValueType VarType, ExprAST* Start, ExprAST* End, ExprAST* Step,
+                       ExprAST* Body, bool Pure)
+                : ExprAST(EK_For, Pure), VarName(VarName), VarType(VarType), Ops{Start, Body, Step ? Step : End, End},
+                  NumOps(Step ? 4 : 3) {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_For;}
+            bool hasStep() const {return NumOps == 4;}
+            ArrayRef<ExprAST*> getOperands() const override {return makeArrayRef(Ops, NumOps);}
+            bool beginOperand(CodeGen& CG, unsigned Idx, ArrayRef<Value*> Done, EmitState& State) override;
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
+    };
+
+    /// VarExprAST - Expression class for var/in. Each variable is bound from its
+    /// initializer before the next initializer is evaluated, and all of them are in
+    /// scope for the body. The operands are the initializers followed by the body.
+    class VarExprAST : public ExprAST{
+        private:
+            ArrayRef<SymbolID> VarNames;
+            ArrayRef<ValueType> VarTypes;
+            ArrayRef<ExprAST*> Ops;     // Initializers, then the body.
+
+        public:
+            VarExprAST(ArrayRef<SymbolID> VarNames, ArrayRef<ValueType> VarTypes, ArrayRef<ExprAST*> Ops, bool Pure)
+                : ExprAST(EK_Var, Pure), VarNames(VarNames), VarTypes(VarTypes), Ops(Ops) {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Var;}
+            ArrayRef<ExprAST*> getOperands() const override {return Ops;}
+            bool beginOperand(CodeGen& CG, unsigned Idx, ArrayRef<Value*> Done, EmitState& State) override;
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
+    };
+
+    /// AssignExprAST - Expression class for "name = value", which stores to the
+    /// variable and evaluates to the value.
+    class AssignExprAST : public ExprAST{
+        private:
+            SymbolID VarName;
+            ExprAST* Val;
 
         public:
-            CallExprAST(const std::string& Callee, std::vector<std::unique_ptr<ExprAST> > Args)
-                : Callee(Callee), Args(std::move(Args)) {}
-            Value* codegen() override;
+            AssignExprAST(SymbolID VarName, ExprAST* Val, bool Pure)
+                : ExprAST(EK_Assign, Pure), VarName(VarName), Val(Val) {}
+            static bool classof(const ExprAST* E) {return E->getKind() == EK_Assign;}
+            ArrayRef<ExprAST*> getOperands() const override {return makeArrayRef(Val);}
+            Value* emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State) override;
+            void hashNode(MD5& Hash, const HashContext& Ctx) const override;
     };
 
     /// PrototypeAST - This class represents the "prototype" for a function,
     /// which captures its name, and its argument names (thus implicitly the number
-    /// of arguments the function takes).
+    /// of arguments the function takes) and types, as well as whether it implements
+    /// a user defined operator. Prototypes outlive the item they were parsed in (see
+    /// FunctionProtos), so they are heap allocated rather than placed in the AST arena.
     class PrototypeAST{
         private:
-            std::string Name;
-            std::vector<std::string> Args;
+            SymbolID Symbol;
+            StringRef Name;         // Owned by the symbol table.
+            std::vector<SymbolID> Args;
+            std::vector<ValueType> ArgTypes;
+            ValueType ReturnType;
+            char Operator;          // 0 if this is not an operator
+            unsigned Precedence;    // Precedence if a binary op.
+            bool Definition;        // Parsed from a def rather than an extern.
+            bool ReadNone = false;  // Known not to touch memory.
+            bool NoUnwind = false;  // Known not to unwind.
+            bool WillReturn = false; // Known to return, as the host's libm functions do.
 
         public:
-            PrototypeAST(const std::string& Name, std::vector<std::string> Args)
-                : Name(Name), Args(std::move(Args)) {}
-            Function* codegen();
-            const std::string& getName() const {return Name;}
-            const std::vector<std::string> getArgs() const {return Args;}
+            /// PrototypeAST - ArgTypes may be left empty for arguments that are all f64.
+            PrototypeAST(SymbolID Symbol, StringRef Name, std::vector<SymbolID> Args, char Operator = 0,
+                         unsigned Prec = 0, bool Definition = false, std::vector<ValueType> ArgTypes = {},
+                         ValueType ReturnType = vt_f64)
+                : Symbol(Symbol), Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)),
+                  ReturnType(ReturnType), Operator(Operator), Precedence(Prec), Definition(Definition){
+                if(this->ArgTypes.empty())
+                    this->ArgTypes.resize(this->Args.size(), vt_f64);
+            }
+            Function* codegen(CodeGen& CG) const;
+            void addToHash(MD5& Hash, const HashContext& Ctx) const;
+            SymbolID getSymbol() const {return Symbol;}
+            StringRef getName() const {return Name;}
+            const std::vector<SymbolID>& getArgs() const {return Args;}
+            const std::vector<ValueType>& getArgTypes() const {return ArgTypes;}
+            ValueType getReturnType() const {return ReturnType;}
+
+            /// hasSameTypes - Other takes arguments of the same types and returns the same type.
+            bool hasSameTypes(const PrototypeAST& Other) const{
+                return ArgTypes == Other.ArgTypes && ReturnType == Other.ReturnType;
+            }
+            /// isAllF64 - Every argument and the result are f64, as for the tutorial's functions.
+            bool isAllF64() const{
+                return ReturnType == vt_f64 && llvm::all_of(ArgTypes, [](ValueType Ty){ return Ty == vt_f64; });
+            }
+
+            bool isUnaryOp() const {return Operator && Args.size() == 1;}
+            bool isBinaryOp() const {return Operator && Args.size() == 2;}
+            char getOperatorName() const {return Operator;}
+            unsigned getBinaryPrecedence() const {return Precedence;}
+            bool isDefinition() const {return Definition;}
+
+            bool isReadNone() const {return ReadNone;}
+            bool isNoUnwind() const {return NoUnwind;}
+            bool isWillReturn() const {return WillReturn;}
+            void setAttributes(bool IsReadNone, bool IsNoUnwind, bool IsWillReturn = false){
+                ReadNone = IsReadNone;
+                NoUnwind = IsNoUnwind;
+                WillReturn = IsWillReturn;
+            }
     };
 
     /// FunctionAST - This class represents a function definition itself.
     class FunctionAST{
         private:
             std::unique_ptr<PrototypeAST> Proto;
-            std::unique_ptr<ExprAST> Body;
+            ExprAST* Body;
 
         public:
-            FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-                : Proto(std::move(Proto)), Body(std::move(Body)) {}
-            Function* codegen();
+            FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST* Body)
+                : Proto(std::move(Proto)), Body(Body) {}
+            Function* codegen(CodeGen& CG, bool Optimize = true);
+            Function* codegenMap(CodeGen& CG);
+            void codegenMemo(CodeGen& CG, Function& F, bool Optimize);
+            void inferAttributes(Function& F);
+            void addToHash(MD5& Hash, const HashContext& Ctx) const;
+            const PrototypeAST& getProto() const {return *Proto;}
     };
 } // end of anonymous namespace
 
+/// PrototypeMap - Prototypes of every function defined or declared so far, so any
+/// module can re-declare them.
+typedef DenseMap<SymbolID, std::unique_ptr<PrototypeAST> > PrototypeMap;
+
+/// checkRedefinition - Callers compiled against an extern or an earlier definition
+/// pass what it takes, so a new definition has to take the same. Returns the
+/// error if New doesn't, or null.
+static const char* checkRedefinition(const PrototypeAST& Old, const PrototypeAST& New){
+    if(Old.getArgs().size() != New.getArgs().size())
+        return "Function redefined with a different number of arguments";
+    if(!Old.hasSameTypes(New))
+        return "Function redefined with different argument or result types";
+    return nullptr;
+}
+
 //------------------------------------------------------------------------------------------------------//
 // End of AST
 //------------------------------------------------------------------------------------------------------//
@@ -208,188 +1051,645 @@ namespace{
 // Parser
 //------------------------------------------------------------------------------------------------------//
 
-/// CurTok/getNextToken - Provide a simple toekn buffer, CurTok is the current token the parser is looking at.
-/// getNextToken reads another token from the lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken(){
-    return CurTok = gettok();
+/// makeDefaultBinopPrecedence - Precedence of the builtin binary operators.
+/// 1 is lowest precedence, characters that are not binary operators hold -1.
+static constexpr std::array<int, 256> makeDefaultBinopPrecedence(){
+    std::array<int, 256> Table{};
+    for(auto& Prec : Table)
+        Prec = -1;
+
+    Table['='] = 2;
+    Table['<'] = 10;
+    Table['+'] = 20;
+    Table['-'] = 20;
+    Table['*'] = 40;
+    Table['/'] = 40; // highest.
+    return Table;
 }
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
+/// ErrorLog - Where LogError reports the errors of this thread instead, while an
+/// embedded engine works on it (see ErrorLogScope).
+static thread_local std::string* ErrorLog = nullptr;
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char* Str){
-    std::cout << "Error: " << Str << std::endl;
+ExprAST* LogError(const char* Str){
+    if(ErrorLog)
+        (*ErrorLog += Str) += '\n';
+    else
+        std::cout << "Error: " << Str << std::endl;
     return nullptr;
 }
 
+/// logDiagnostic - LLVM diagnostic handler that reports errors with LogError and
+/// drops the warnings and remarks.
+static void logDiagnostic(const DiagnosticInfo& DI, void* /*Context*/){
+    if(DI.getSeverity() != DS_Error)
+        return;
+    std::string Msg;
+    raw_string_ostream OS(Msg);
+    DiagnosticPrinterRawOStream DP(OS);
+    DI.print(DP);
+    LogError(OS.str().c_str());
+}
+
 std::unique_ptr<PrototypeAST> LogErrorP(const char* Str){
     LogError(Str);
     return nullptr;
 }
 
-/// Declared here so the compiler can resolve the function name, defintion below.
-static std::unique_ptr<ExprAST> ParseExpression();
-
-/// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr(){
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken();
-    return std::move(Result);
-}
+/// Parser - Builds top-level items from the lexer's tokens. Expression nodes are
+/// placed in ASTAllocator, which the driver releases once it is done with them.
+class Parser{
+    private:
+        Lexer& Lex;
+        SymbolTable& Symbols;
+        BumpPtrAllocator ASTAllocator;
+        size_t PeakASTBytes = 0;
 
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr(){
-    getNextToken(); // eat (.
-    auto V = ParseExpression();
-    if(!V)
-        return nullptr;
+        /// BinopPrecedence - This holds the precedence for each binary operator that is
+        /// defined, indexed by the operator character. BinaryOperators and
+        /// UnaryOperators hold the function implementing each user defined operator,
+        /// sym_none for characters that aren't one.
+        std::array<int, 256> BinopPrecedence = makeDefaultBinopPrecedence();
+        std::array<SymbolID, 256> BinaryOperators{};
+        std::array<SymbolID, 256> UnaryOperators{};
 
-    if(CurTok != ')')
-        return LogError("expected ')'");
+        /// PureFunctions - Definitions whose bodies are pure, so calls to them are too.
+        DenseSet<SymbolID> PureFunctions;
 
-    getNextToken(); // eat ).
-    return V;
-}
+        /// newAST - Allocate an expression node in the AST arena.
+        template<typename T, typename... ArgTs>
+        T* newAST(ArgTs&&... Args){
+            ++NumASTNodes;
+            return new (ASTAllocator.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+        }
 
-/// identifierexpr
-///     ::= identifier
-///     ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr(){
-    std::string IdName = IdentifierStr;
+        /// copyToArena - Copy a list built up while parsing into storage owned by the AST arena.
+        template<typename T>
+        ArrayRef<T> copyToArena(ArrayRef<T> Elts){
+            T* Mem = ASTAllocator.Allocate<T>(Elts.size());
+            std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+            return makeArrayRef(Mem, Elts.size());
+        }
 
-    getNextToken(); // eat identifier.
+        int getTokPrecedence();
+        ExprAST* makeUnary(char Op, ExprAST* Operand);
+        ExprAST* makeBinary(char Op, ExprAST* LHS, ExprAST* RHS);
+        ExprAST* makeCall(SymbolID Callee, ArrayRef<ExprAST*> Args);
+        ExprAST* makeIf(ExprAST* Cond, ExprAST* Then, ExprAST* Else);
+        ExprAST* makeFor(SymbolID VarName, ValueType VarType, ExprAST* Start, ExprAST* End, ExprAST* Step,
+                         ExprAST* Body);
+        ExprAST* makeVar(ArrayRef<SymbolID> VarNames, ArrayRef<ValueType> VarTypes, ArrayRef<ExprAST*> Inits,
+                         ExprAST* Body);
+        ExprAST* makeAssign(ExprAST* LHS, ExprAST* RHS);
+        ExprAST* ParseExpression();
+        bool ParseTypeAnnotation(ValueType& Ty);
+        std::unique_ptr<PrototypeAST> ParsePrototype();
 
-    if(CurTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(IdName);
+    public:
+        /// CurTok/getNextToken - Provide a simple toekn buffer, CurTok is the current token the parser is looking at.
+        /// getNextToken reads another token from the lexer and updates CurTok with its results.
+        int CurTok;
+        int getNextToken(){
+            ++NumTokens;
+            return CurTok = Lex.gettok();
+        }
 
-    // Call.
-    getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST> > Args;
-    if(CurTok != ')'){
-        while(true){
-            if(auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
+        Parser(Lexer& Lex, SymbolTable& Symbols) : Lex(Lex), Symbols(Symbols) {}
 
-            if(CurTok == ')')
-                break;
+        /// releaseAST - Free every expression node parsed so far at once.
+        void releaseAST(){
+            PeakASTBytes = std::max(PeakASTBytes, ASTAllocator.getBytesAllocated());
+            ASTAllocator.Reset();
+        }
 
-            if(CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
+        /// takeAST - Hand every expression node parsed so far over to the caller,
+        /// who frees them by destroying the returned arena. Later nodes go into a
+        /// new one.
+        BumpPtrAllocator takeAST(){
+            PeakASTBytes = std::max(PeakASTBytes, ASTAllocator.getBytesAllocated());
+            BumpPtrAllocator Taken(std::move(ASTAllocator));
+            return Taken;
+        }
 
-            getNextToken();
-       }
-    }
+        /// getASTBytes - The memory the arena holds now, and the most the nodes of
+        /// any one release took.
+        size_t getASTBytes() const {return ASTAllocator.getTotalMemory();}
+        size_t getPeakASTBytes() const {return PeakASTBytes;}
 
-    // Eat the ')'.
-    getNextToken();
+        /// registerBinaryOperator - Make Op parse as a binary operator with precedence
+        /// Prec, implemented by the function Fn.
+        void registerBinaryOperator(char Op, int Prec, SymbolID Fn){
+            BinopPrecedence[(unsigned char)Op] = Prec;
+            BinaryOperators[(unsigned char)Op] = Fn;
+        }
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
+        /// registerUnaryOperator - Make Op parse as a prefix unary operator implemented
+        /// by the function Fn.
+        void registerUnaryOperator(char Op, SymbolID Fn){
+            UnaryOperators[(unsigned char)Op] = Fn;
+        }
 
-/// primary
-///     ::= identifierexpr
-///     ::= numberexpr
-///     ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary(){
-    switch(CurTok){
-        default:
-            return LogError("Unknown token when expecting an expression");
-        case tok_identifier:
-            return ParseIdentifierExpr();
-        case tok_number:
-            return ParseNumberExpr();
-        case '(':
-            return ParseParenExpr();
-    }
-}
+        std::unique_ptr<FunctionAST> ParseDefinition();
+        std::unique_ptr<PrototypeAST> ParseExtern();
+        std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+};
 
-static int getTokPrecedence(){
-    if(!isascii(CurTok))
+/// getTokPrecedence - Get the precedence of the pending binary operator token, or
+/// -1 if it isn't a declared binop.
+int Parser::getTokPrecedence(){
+    if(CurTok < 0)
         return -1;
+    return BinopPrecedence[CurTok];
+}
 
-    // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[CurTok];
-    if(TokPrec <= 0) return -1;
-    return TokPrec;
+/// makeUnary - Build a call of the user defined unary operator Op.
+ExprAST* Parser::makeUnary(char Op, ExprAST* Operand){
+    SymbolID Fn = UnaryOperators[(unsigned char)Op];
+    return newAST<UnaryExprAST>(Op, Fn, Operand, PureFunctions.count(Fn) && Operand->isPure());
 }
 
-/// binoprhs
-/// ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS){
-    // If this is a binop, find its precedence.
-    while(true){
-        int TokPrec = getTokPrecedence();
+/// makeCall - Build a call of Callee, copying Args into the AST arena.
+ExprAST* Parser::makeCall(SymbolID Callee, ArrayRef<ExprAST*> Args){
+    bool Pure = PureFunctions.count(Callee) && all_of(Args, [](ExprAST* Arg){ return Arg->isPure(); });
+    return newAST<CallExprAST>(Callee, copyToArena(Args), Pure);
+}
 
-        // If this is a binop that binds at least as tightly as the current binop,
-        // consume it, otherwise we are done.
-        if(TokPrec < ExprPrec)
-            return LHS;
+/// makeIf - Build if Cond then Then else Else. A constant condition picks its
+/// branch right away.
+ExprAST* Parser::makeIf(ExprAST* Cond, ExprAST* Then, ExprAST* Else){
+    if(auto* C = dyn_cast<NumberExprAST>(Cond))
+        return C->getVal() < 0.0 || C->getVal() > 0.0 ? Then : Else;   // fcmp one, so NaN is false.
 
-        // Okay, we know this is a binop.
-        int BinOp = CurTok; // remember binop
-        getNextToken(); // eat binop
+    return newAST<IfExprAST>(Cond, Then, Else, Cond->isPure() && Then->isPure() && Else->isPure());
+}
 
-        // Parse the primary expression after the binary operator.
-        auto RHS = ParsePrimary();
-        if(!RHS)
-            return nullptr;
+/// makeFor - Build for VarName = Start, End, Step in Body. Step may be null.
+ExprAST* Parser::makeFor(SymbolID VarName, ValueType VarType, ExprAST* Start, ExprAST* End, ExprAST* Step,
+                         ExprAST* Body){
+    bool Pure = Start->isPure() && End->isPure() && (!Step || Step->isPure()) && Body->isPure();
+    return newAST<ForExprAST>(VarName, VarType, Start, End, Step, Body, Pure);
+}
 
-        // If BinOp binds less tightly with RHS that the operator after RHS, let
-        // the pending operator take RHS as its LHS.
-        int NextPrec = getTokPrecedence();
-        if(TokPrec < NextPrec){
-            RHS = ParseBinOpRHS(TokPrec+1, std::move(RHS));
-            if(!RHS)
-                return nullptr;
-        }
+/// makeVar - Build var VarNames[0] = Inits[0], ... in Body, copying the bindings
+/// into the AST arena.
+ExprAST* Parser::makeVar(ArrayRef<SymbolID> VarNames, ArrayRef<ValueType> VarTypes, ArrayRef<ExprAST*> Inits,
+                         ExprAST* Body){
+    SmallVector<ExprAST*, 8> Ops(Inits.begin(), Inits.end());
+    Ops.push_back(Body);
+    bool Pure = all_of(Ops, [](ExprAST* Op){ return Op->isPure(); });
+    return newAST<VarExprAST>(copyToArena(VarNames), copyToArena(VarTypes), copyToArena<ExprAST*>(Ops), Pure);
+}
 
-        // Merge LHS/RHS.
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-    } // loop around to the top of the while loop.
+/// makeAssign - Build LHS = RHS. Only variables can be assigned to. Storing to a
+/// local doesn't make an expression impure, it is still only computed from the
+/// function's arguments.
+ExprAST* Parser::makeAssign(ExprAST* LHS, ExprAST* RHS){
+    auto* Dest = dyn_cast<VariableExprAST>(LHS);
+    if(!Dest)
+        return LogError("destination of '=' must be a variable");
+    return newAST<AssignExprAST>(Dest->getName(), RHS, RHS->isPure());
 }
 
-/// expression
-///     ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression(){
-    auto LHS = ParsePrimary();
-    if(!LHS)
-        return nullptr;
+/// makeBinary - Build LHS Op RHS, simplifying it where that can't change the
+/// result. Builtin operators on two constants are folded, with the same IEEE
+/// double arithmetic the generated code would do, so constant-only subtrees
+/// collapse to one number as they are parsed. Identities that hold for every
+/// double, including NaNs, infinities and signed zeros, drop the operation:
+/// x*1, 1*x, x/1, x-0.0, x+-0.0 and -0.0+x. Anything less exact (x+0.0, x*0,
+/// reassociating (x+1)+2) is left for LLVM, which knows when it is allowed.
+ExprAST* Parser::makeBinary(char Op, ExprAST* LHS, ExprAST* RHS){
+    if(Op == '=')
+        return makeAssign(LHS, RHS);
 
-    return ParseBinOpRHS(0, std::move(LHS));
-}
+    if(!isBuiltinBinaryOp(Op)){
+        SymbolID Fn = BinaryOperators[(unsigned char)Op];
+        bool Pure = PureFunctions.count(Fn) && LHS->isPure() && RHS->isPure();
+        return newAST<BinaryExprAST>(Op, Fn, LHS, RHS, Pure);
+    }
 
-/// prototype
-///     ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype(){
-    // Remember if function is externl of defined internally
-    int FnType = CurTok;
-    getNextToken(); // eat extern or def
-    if(CurTok != tok_identifier)
-        return LogErrorP("Expected function name in prototype");
+    auto* L = dyn_cast<NumberExprAST>(LHS);
+    auto* R = dyn_cast<NumberExprAST>(RHS);
+    if(L && R){
+        double A = L->getVal(), B = R->getVal();
+        switch(Op){
+            case '+':
+                return newAST<NumberExprAST>(A + B);
+            case '-':
+                return newAST<NumberExprAST>(A - B);
+            case '*':
+                return newAST<NumberExprAST>(A * B);
+            case '/':
+                return newAST<NumberExprAST>(A / B);
+            case '<':
+                // Matches the unordered compare codegen emits: true if either is a NaN.
+                return newAST<NumberExprAST>(!(A >= B) ? 1.0 : 0.0);
+        }
+    }
+
+    auto isConstant = [](NumberExprAST* N, double V){
+        return N && N->getVal() == V && std::signbit(N->getVal()) == std::signbit(V);
+    };
 
-    std::string FnName = IdentifierStr;
-    switch(FnType){
-        case tok_def:
-            FnName.append("_def");
+    switch(Op){
+        case '*':
+            if(isConstant(R, 1.0))
+                return LHS;
+            if(isConstant(L, 1.0))
+                return RHS;
+            break;
+        case '/':
+            if(isConstant(R, 1.0))
+                return LHS;
             break;
-        case tok_extern:
-            FnName.append("_ext");
+        case '-':
+            if(isConstant(R, 0.0))
+                return LHS;
+            break;
+        case '+':
+            if(isConstant(R, -0.0))
+                return LHS;
+            if(isConstant(L, -0.0))
+                return RHS;
             break;
     }
-    getNextToken();
 
-    if(CurTok != '(')
+    return newAST<BinaryExprAST>(Op, sym_none, LHS, RHS, LHS->isPure() && RHS->isPure());
+}
+
+/// expression
+///     ::= unary binoprhs
+/// binoprhs
+///     ::= (binop unary)*
+/// unary
+///     ::= primary
+///     ::= unaryop unary
+/// primary
+///     ::= identifier
+///     ::= identifier '(' expression* ')'
+///     ::= number
+///     ::= '(' expression ')'
+///     ::= 'if' expression 'then' expression 'else' expression
+///     ::= 'for' identifier type? '=' expression ',' expression (',' expression)? 'in' expression
+///     ::= 'var' identifier type? ('=' expression)? (',' identifier type? ('=' expression)?)* 'in' expression
+/// type
+///     ::= ':' ('f64' | 'f32' | 'i64')
+///
+/// '=' assigns to a variable. It binds loosest of all and, unlike the other binary
+/// operators, associates to the right, so "a = b = 0" sets both.
+///
+/// This is parsed with explicit stacks of pending operators and finished operands
+/// (shunting-yard) rather than by recursive descent, so neither deep nesting nor
+/// long operator chains need more C++ stack, and the work is linear in the length
+/// of the expression.
+ExprAST* Parser::ParseExpression(){
+    /// PendingOp - An operator or group still waiting for operands. Calls, ifs,
+    /// fors and vars record where their first operand sits in Operands, vars also
+    /// where their first name sits in VarNames. Name is the function called or the
+    /// loop variable.
+    struct PendingOp{
+        enum OpKind {Unary, Binary, Paren, Call, If, For, Var} Kind;
+        char Op = 0;
+        int Prec = 0;
+        SymbolID Name = sym_none;
+        size_t FirstArg = 0;
+        bool HasStep = false;
+        size_t FirstName = 0;
+        ValueType VarType = vt_infer;
+    };
+    SmallVector<PendingOp, 16> Ops;
+    SmallVector<ExprAST*, 16> Operands;
+    SmallVector<SymbolID, 8> VarNames;
+    SmallVector<ValueType, 8> VarTypes;
+
+    // reduceBinaries - Build every pending binary operator that binds at least as
+    // tightly as Prec. Stopping at equal precedence keeps operators left associative.
+    auto reduceBinaries = [&](int Prec){
+        while(!Ops.empty() && Ops.back().Kind == PendingOp::Binary && Ops.back().Prec >= Prec){
+            char Op = Ops.pop_back_val().Op;
+            ExprAST* RHS = Operands.pop_back_val();
+            ExprAST* LHS = Operands.pop_back_val();
+            ExprAST* Result = makeBinary(Op, LHS, RHS);
+            if(!Result)
+                return false;
+            Operands.push_back(Result);
+        }
+        return true;
+    };
+
+    // parseVarBindings - Read the bindings after 'var' or a ',' between them, up to
+    // one with an initializer, whose expression comes next, or up to 'in', after
+    // which the body comes. A variable without an initializer starts out as 0.0.
+    auto parseVarBindings = [&](){
+        while(true){
+            if(CurTok != tok_identifier){
+                LogError("expected identifier after var");
+                return false;
+            }
+            VarNames.push_back(Lex.IdentifierSym);
+            getNextToken(); // eat identifier.
+
+            VarTypes.push_back(vt_infer);
+            if(CurTok == ':' && !ParseTypeAnnotation(VarTypes.back()))
+                return false;
+
+            if(CurTok == '='){
+                getNextToken(); // eat '='.
+                return true;
+            }
+            Operands.push_back(newAST<NumberExprAST>(0.0));
+
+            if(CurTok != ',')
+                break;
+            getNextToken(); // eat ','.
+        }
+
+        if(CurTok != tok_in){
+            LogError("expected 'in' keyword after 'var'");
+            return false;
+        }
+        getNextToken(); // eat 'in'.
+        return true;
+    };
+
+    while(true){
+        // Expecting an operand: any number of prefix operators, then a primary.
+        while(CurTok >= 0 && UnaryOperators[CurTok] != sym_none){
+            Ops.push_back({PendingOp::Unary, (char)CurTok});
+            getNextToken();
+        }
+
+        switch(CurTok){
+            default:
+                return LogError("Unknown token when expecting an expression");
+            case tok_number:
+                Operands.push_back(newAST<NumberExprAST>(Lex.NumVal));
+                getNextToken();
+                break;
+            case tok_identifier:{
+                SymbolID IdName = Lex.IdentifierSym;
+                getNextToken(); // eat identifier.
+
+                if(CurTok != '('){ // Simple variable ref.
+                    Operands.push_back(newAST<VariableExprAST>(IdName));
+                    break;
+                }
+
+                // Call.
+                getNextToken(); // eat (
+                if(CurTok == ')'){
+                    getNextToken();
+                    Operands.push_back(makeCall(IdName, None));
+                    break;
+                }
+
+                // Its first argument comes next.
+                Ops.push_back({PendingOp::Call, 0, 0, IdName, Operands.size()});
+                continue;
+            }
+            case '(':
+                getNextToken(); // eat (.
+                Ops.push_back({PendingOp::Paren});
+                continue;
+            case tok_if:
+                getNextToken(); // eat the if.
+                Ops.push_back({PendingOp::If, 0, 0, sym_none, Operands.size()});
+                continue;
+            case tok_for:{
+                getNextToken(); // eat the for.
+                if(CurTok != tok_identifier)
+                    return LogError("expected identifier after for");
+
+                SymbolID IdName = Lex.IdentifierSym;
+                getNextToken(); // eat identifier.
+                ValueType VarType = vt_infer;
+                if(CurTok == ':' && !ParseTypeAnnotation(VarType))
+                    return nullptr;
+                if(CurTok != '=')
+                    return LogError("expected '=' after for");
+                getNextToken(); // eat '='.
+
+                Ops.push_back({PendingOp::For, 0, 0, IdName, Operands.size()});
+                Ops.back().VarType = VarType;
+                continue;
+            }
+            case tok_var:
+                getNextToken(); // eat the var.
+                Ops.push_back({PendingOp::Var, 0, 0, sym_none, Operands.size(), false, VarNames.size()});
+                if(!parseVarBindings())
+                    return nullptr;
+                continue;
+        }
+
+        // An operand is complete. Apply its prefix operators, then see whether a
+        // binary operator follows or a group (or the whole expression) ends here.
+        while(true){
+            while(!Ops.empty() && Ops.back().Kind == PendingOp::Unary){
+                char Op = Ops.pop_back_val().Op;
+                Operands.back() = makeUnary(Op, Operands.back());
+            }
+
+            int TokPrec = getTokPrecedence();
+            if(TokPrec >= 0){
+                // An '=' to the left stays pending, so assignments nest to the right.
+                if(!reduceBinaries(CurTok == '=' ? TokPrec + 1 : TokPrec))
+                    return nullptr;
+                Ops.push_back({PendingOp::Binary, (char)CurTok, TokPrec});
+                getNextToken(); // eat binop
+                break;
+            }
+
+            if(!reduceBinaries(0))
+                return nullptr;
+            if(Ops.empty())
+                return Operands.pop_back_val();
+
+            PendingOp& Top = Ops.back();
+            size_t NumDone = Operands.size() - Top.FirstArg;
+            if(Top.Kind == PendingOp::Paren){
+                if(CurTok != ')')
+                    return LogError("expected ')'");
+                getNextToken(); // eat ).
+                Ops.pop_back();
+                continue;
+            }
+
+            if(Top.Kind == PendingOp::If){
+                if(NumDone == 1 || NumDone == 2){
+                    if(NumDone == 1 && CurTok != tok_then)
+                        return LogError("expected then");
+                    if(NumDone == 2 && CurTok != tok_else)
+                        return LogError("expected else");
+                    getNextToken(); // eat the then or else.
+                    break;
+                }
+
+                ExprAST* Else = Operands.pop_back_val();
+                ExprAST* Then = Operands.pop_back_val();
+                ExprAST* Cond = Operands.pop_back_val();
+                Ops.pop_back();
+                Operands.push_back(makeIf(Cond, Then, Else));
+                continue;
+            }
+
+            if(Top.Kind == PendingOp::For){
+                // The start value is followed by ',', the end condition by ',' when a
+                // step follows, and the step (or end condition) by 'in' and the body.
+                if(NumDone == 1 || (NumDone == 2 && CurTok == ',')){
+                    if(CurTok != ',')
+                        return LogError("expected ',' after for start value");
+                    Top.HasStep = NumDone == 2;
+                    getNextToken(); // eat ','.
+                    break;
+                }
+                if(NumDone == 2 || (NumDone == 3 && Top.HasStep)){
+                    if(CurTok != tok_in)
+                        return LogError("expected 'in' after for");
+                    getNextToken(); // eat 'in'.
+                    break;
+                }
+
+                ExprAST* Body = Operands.pop_back_val();
+                ExprAST* Step = Top.HasStep ? Operands.pop_back_val() : nullptr;
+                ExprAST* End = Operands.pop_back_val();
+                ExprAST* Start = Operands.pop_back_val();
+                SymbolID VarName = Top.Name;
+                ValueType VarType = Top.VarType;
+                Ops.pop_back();
+                Operands.push_back(makeFor(VarName, VarType, Start, End, Step, Body));
+                continue;
+            }
+
+            if(Top.Kind == PendingOp::Var){
+                // Every finished initializer has its name; the body is the one extra.
+                size_t NumNames = VarNames.size() - Top.FirstName;
+                if(NumDone == NumNames){
+                    if(CurTok == ','){
+                        getNextToken(); // eat ','.
+                        if(!parseVarBindings())
+                            return nullptr;
+                        break;
+                    }
+                    if(CurTok != tok_in)
+                        return LogError("expected 'in' keyword after 'var'");
+                    getNextToken(); // eat 'in'.
+                    break;
+                }
+
+                ExprAST* Body = Operands.pop_back_val();
+                ExprAST* Result = makeVar(makeArrayRef(VarNames).drop_front(Top.FirstName),
+                                          makeArrayRef(VarTypes).drop_front(Top.FirstName),
+                                          makeArrayRef(Operands).drop_front(Top.FirstArg), Body);
+                Operands.truncate(Top.FirstArg);
+                VarNames.truncate(Top.FirstName);
+                VarTypes.truncate(Top.FirstName);
+                Ops.pop_back();
+                Operands.push_back(Result);
+                continue;
+            }
+
+            // The innermost group is a call's argument list.
+            if(CurTok == ','){
+                getNextToken();
+                break;
+            }
+
+            if(CurTok != ')')
+                return LogError("Expected ')' or ',' in argument list");
+            getNextToken(); // eat the ')'.
+
+            PendingOp Call = Ops.pop_back_val();
+            ExprAST* Result = makeCall(Call.Name, makeArrayRef(Operands).drop_front(Call.FirstArg));
+            Operands.truncate(Call.FirstArg);
+            Operands.push_back(Result);
+        }
+    }
+}
+
+/// type ::= ':' ('f64' | 'f32' | 'i64')
+bool Parser::ParseTypeAnnotation(ValueType& Ty){
+    getNextToken(); // eat ':'.
+    StringRef Name = CurTok == tok_identifier ? Symbols.getName(Lex.IdentifierSym) : StringRef();
+    if(Name == "f64")
+        Ty = vt_f64;
+    else if(Name == "f32")
+        Ty = vt_f32;
+    else if(Name == "i64")
+        Ty = vt_i64;
+    else{
+        LogError("Expected f64, f32 or i64 after ':'");
+        return false;
+    }
+    getNextToken(); // eat the type.
+    return true;
+}
+
+/// prototype
+///     ::= id '(' (id type?)* ')' type?
+///     ::= binary LETTER number? (id type?, id type?) type?
+///     ::= unary LETTER (id type?) type?
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype(){
+    // Remember if function is external or defined internally
+    bool IsDefinition = CurTok == tok_def;
+    getNextToken(); // eat extern or def
+
+    SmallString<32> FnName;
+    char Operator = 0;
+    unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
+    unsigned BinaryPrecedence = 30;
+
+    switch(CurTok){
+        default:
+            return LogErrorP("Expected function name in prototype");
+        case tok_identifier:
+            FnName = Symbols.getName(Lex.IdentifierSym);
+            getNextToken();
+            break;
+        case tok_unary:
+            getNextToken();
+            if(!isascii(CurTok))
+                return LogErrorP("Expected unary operator");
+            FnName = "unary";
+            Operator = CurTok;
+            FnName.push_back(Operator);
+            Kind = 1;
+            getNextToken();
+            break;
+        case tok_binary:
+            getNextToken();
+            if(!isascii(CurTok))
+                return LogErrorP("Expected binary operator");
+            FnName = "binary";
+            Operator = CurTok;
+            FnName.push_back(Operator);
+            Kind = 2;
+            getNextToken();
+
+            // Read the precedence if present.
+            if(CurTok == tok_number){
+                if(Lex.NumVal < 1 || Lex.NumVal > 100)
+                    return LogErrorP("Invalid precedence: must be 1..100");
+                BinaryPrecedence = (unsigned)Lex.NumVal;
+                getNextToken();
+            }
+            break;
+    }
+
+    if(CurTok != '(')
         return LogErrorP("Expected '(' in protype");
 
-    // Read the list of argument names.
-    std::vector<std::string> ArgNames;
-    while(getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
+    // Read the list of argument names and types.
+    std::vector<SymbolID> ArgNames;
+    std::vector<ValueType> ArgTypes;
+    getNextToken(); // eat '('
+    while(CurTok == tok_identifier){
+        ArgNames.push_back(Lex.IdentifierSym);
+        getNextToken(); // eat identifier.
+
+        ArgTypes.push_back(vt_f64);
+        if(CurTok == ':' && !ParseTypeAnnotation(ArgTypes.back()))
+            return nullptr;
+    }
 
     if(CurTok != ')')
         return LogErrorP("Expected ')' in prototype");
@@ -397,31 +1697,57 @@ static std::unique_ptr<PrototypeAST> ParsePrototype(){
     // success.
     getNextToken(); // eat ')'
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    ValueType ReturnType = vt_f64;
+    if(CurTok == ':' && !ParseTypeAnnotation(ReturnType))
+        return nullptr;
+
+    // Verify right number of names for operator.
+    if(Kind && ArgNames.size() != Kind)
+        return LogErrorP("Invalid number of operands for operator");
+
+    SymbolID FnSym = Symbols.intern(FnName);
+    return std::make_unique<PrototypeAST>(FnSym, Symbols.getName(FnSym), std::move(ArgNames), Operator,
+                                          BinaryPrecedence, IsDefinition, std::move(ArgTypes), ReturnType);
 }
 
 /// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition(){
+std::unique_ptr<FunctionAST> Parser::ParseDefinition(){
     auto Proto = ParsePrototype();
     if(!Proto) return nullptr;
 
-    if(auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    // A user defined operator is usable from its own body on, so it can recurse.
+    if(Proto->isBinaryOp())
+        registerBinaryOperator(Proto->getOperatorName(), Proto->getBinaryPrecedence(), Proto->getSymbol());
+    else if(Proto->isUnaryOp())
+        registerUnaryOperator(Proto->getOperatorName(), Proto->getSymbol());
+
+    if(auto E = ParseExpression()){
+        // Calls to a pure definition are pure, and it neither touches memory nor
+        // unwinds. A body calling itself is never counted as pure here, IR level
+        // inference in FunctionAST::codegen handles recursion.
+        if(E->isPure())
+            PureFunctions.insert(Proto->getSymbol());
+        else
+            PureFunctions.erase(Proto->getSymbol());
+        Proto->setAttributes(E->isPure(), E->isPure());
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
+    }
 
     return nullptr;
 }
 
 /// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern(){
+std::unique_ptr<PrototypeAST> Parser::ParseExtern(){
     return ParsePrototype();
 }
 
 /// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr(){
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr(){
     if(auto E = ParseExpression()){
         // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto = std::make_unique<PrototypeAST>(sym_anon_expr, Symbols.getName(sym_anon_expr),
+                                                    std::vector<SymbolID>());
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     }
     return nullptr;
 }
@@ -434,235 +1760,3062 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr(){
 // Code Generation
 //------------------------------------------------------------------------------------------------------//
 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<IRBuilder<> > Builder;
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, Value*> NamedValues;
-
-Value* LogErrorV(const char* Str){
-    LogError(Str);
-    return nullptr;
-}
+static ExitOnError ExitOnErr;
 
-Value* NumberExprAST::codegen(){
-    return ConstantFP::get(*TheContext, APFloat(Val));
+/// getFastMathBits - The -fast-math flags for the definition FnName, as a bit per FastMathFlag.
+static unsigned getFastMathBits(StringRef FnName){
+    if(!FastMathFunctions.empty() && !is_contained(FastMathFunctions, FnName))
+        return 0;
+    return FastMath.getBits();
 }
 
-Value* VariableExprAST::codegen(){
-    // Look this variable up in the function.
-    Value* V = NamedValues[Name];
-    if(!V)
-        LogErrorV("Unknown variable name");
-    return V;
+static FastMathFlags getFastMathFlags(StringRef FnName){
+    unsigned Bits = getFastMathBits(FnName);
+    FastMathFlags FMF;
+    if(Bits & (1 << fmf_fast)){
+        FMF.setFast();
+        return FMF;
+    }
+    FMF.setAllowReassoc(Bits & (1 << fmf_reassoc));
+    FMF.setAllowContract(Bits & (1 << fmf_contract));
+    FMF.setNoNaNs(Bits & (1 << fmf_nnan));
+    FMF.setNoInfs(Bits & (1 << fmf_ninf));
+    FMF.setNoSignedZeros(Bits & (1 << fmf_nsz));
+    FMF.setAllowReciprocal(Bits & (1 << fmf_arcp));
+    FMF.setApproxFunc(Bits & (1 << fmf_afn));
+    return FMF;
 }
 
-Value* BinaryExprAST::codegen(){
-    Value* L = LHS->codegen();
-    Value* R = RHS->codegen();
-    if(!L || !R)
-        return nullptr;
-
-    switch(Op){
-        case '+':
-            return Builder->CreateFAdd(L, R, "addtmp");
-        case '-':
-            return Builder->CreateFSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateFMul(L, R, "multmp");
-        case '/':
-            return Builder->CreateFDiv(L, R, "divtmp");
-        case '<':
-            L = Builder->CreateFCmpULT(L, R, "cmptmp");
-            // Convert bool 0/1 to double 0.0 or 1.0
-            return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+static OptimizationLevel getOptimizationLevel(){
+    switch(OptLevel){
+        case '0':
+            return OptimizationLevel::O0;
+        case '1':
+            return OptimizationLevel::O1;
+        case '3':
+            return OptimizationLevel::O3;
         default:
-        return LogErrorV("invalid binary operator");
+            return OptimizationLevel::O2;
     }
 }
 
-Value* CallExprAST::codegen(){
-    // Look up the name in the global module table.
-    Function* CalleeF = TheModule->getFunction(Callee);
-    if(!CalleeF)
-        return LogErrorV("Unknown function referenced");
+/// addOptimizationPasses - Fill in the per-function pipeline for the selected -O level.
+/// -O0 runs nothing, so variables stay in memory. -O1 promotes them to registers
+/// and does cheap peephole and CFG cleanup, -O2 adds GVN to remove
+/// redundant arithmetic and -O3 uses LLVM's full function simplification pipeline.
+/// -O2 and -O3 then vectorize loops, and every level from -O1 unrolls them.
+static void addOptimizationPasses(FunctionPassManager& FPM, PassBuilder& PB){
+    OptimizationLevel Level = getOptimizationLevel();
+    if(Level == OptimizationLevel::O0)
+        return;
 
-    // If argument mismatch error.
-    if(CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # arguments passed");
+    if(Level == OptimizationLevel::O3){
+        // The simplification pipeline leaves vectorizing to the module pipeline's
+        // optimization half, which a definition never goes through, so the loop
+        // passes below still follow it.
+        FPM.addPass(PB.buildFunctionSimplificationPipeline(Level, ThinOrFullLTOPhase::None));
+    }else{
+        // Promote the variables' stack slots to registers.
+        FPM.addPass(PromotePass());
+        // Do simple "peephole" optimizations and bit-twiddling optzns.
+        FPM.addPass(InstCombinePass());
+        // Reassociate expressions.
+        FPM.addPass(ReassociatePass());
+        // Eliminate Common SubExpressions.
+        if(Level == OptimizationLevel::O2)
+            FPM.addPass(GVNPass());
+        // Simplify the control flow graph (deleting unreachable blocks, etc).
+        FPM.addPass(SimplifyCFGPass());
+        // Turn self-recursive tail calls into loops, for the loop passes below.
+        FPM.addPass(TailCallElimPass());
 
-    std::vector<Value*> ArgsV;
-    for(unsigned i =0, e=Args.size(); i != e; ++i){
-        ArgsV.push_back(Args[i]->codegen());
-        if(!ArgsV.back())
-            return nullptr;
+        // Put loops in rotated form, hoist invariant code out of them and turn
+        // floating point induction variables into integer ones, which is what lets
+        // the vectorizer and unroller work out trip counts.
+        LoopPassManager LPM;
+        LPM.addPass(LoopRotatePass());
+        LPM.addPass(LICMPass());
+        LPM.addPass(IndVarSimplifyPass());
+        FPM.addPass(createFunctionToLoopPassAdaptor(std::move(LPM), /*UseMemorySSA*/ true));
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    if(Level != OptimizationLevel::O1)
+        FPM.addPass(LoopVectorizePass());
+    FPM.addPass(LoopUnrollPass(LoopUnrollOptions(Level.getSpeedupLevel())));
+    // Clean up after the loop passes.
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(SimplifyCFGPass());
 }
 
-Function* PrototypeAST::codegen(){
-    // Make the function type: double(double, double) etc.
-    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FunctionType* FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
-    Function* F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+/// addQuickPasses - What even unoptimized definitions get: their variables go to
+/// registers, which makes for less code to compile, and self-recursive tail calls
+/// become loops, so deep recursion works the same at every level.
+static void addQuickPasses(FunctionPassManager& FPM){
+    FPM.addPass(PromotePass());
+    FPM.addPass(TailCallElimPass());
+}
 
-    // Set names for all arguments.
-    unsigned Idx = 0;
-    for(auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
+/// addVectorizationPasses - Extra passes for the .map batch kernels, run after the
+/// usual pipeline: vectorize the row loop, then clean up after the vectorizer.
+static void addVectorizationPasses(FunctionPassManager& FPM){
+    if(getOptimizationLevel() == OptimizationLevel::O0)
+        return;
 
-    return F;
+    FPM.addPass(LoopVectorizePass());
+    FPM.addPass(SLPVectorizerPass());
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(SimplifyCFGPass());
 }
 
-Function* FunctionAST::codegen(){
-    // First, check for an existing function from a previous 'extern' declaration.
-    Function* TheFunction = TheModule->getFunction(Proto->getName());
+/// CodeGen - Everything needed to emit and optimize IR for one module: its own
+/// context, the builder, the variables in scope in the function being emitted and
+/// the pass managers. The optional TargetMachine gives the optimizer the target's
+/// cost model, it must not be shared with another thread. Nothing in here is
+/// shared, so separate CodeGens can run on separate threads as long as the
+/// symbol table and prototypes are left alone.
+class CodeGen{
+    public:
+        const SymbolTable& Symbols;
+        const PrototypeMap& FunctionProtos;
 
-    if(!TheFunction)
-        TheFunction = Proto->codegen();
+        /// TSCtx - The context of every module this CodeGen emits. It is handed to
+        /// the JIT along with each module and then shared with the next one, so the
+        /// types and constants made for one module are there for the next.
+        ThreadSafeContext TSCtx;
+        LLVMContext* TheContext = nullptr;
+        unsigned ModulesInContext = 0;   // Handed out of TSCtx so far, see -context-modules.
+        std::unique_ptr<Module> TheModule;
+        std::unique_ptr<IRBuilder<> > Builder;
 
-    if(!TheFunction)
-        return nullptr;
+        /// SpareFunction - A bodiless function from recycleFunction, out of any
+        /// module, waiting to be the next function of the same type and name.
+        Function* SpareFunction = nullptr;
 
-    if(!TheFunction->empty())
-        return (Function*)LogErrorV("Function cannot be redefined.");
+        /// NamedValues - The stack slot of every variable in scope. Shadowed holds
+        /// what each binding replaced, innermost last, so leaving a scope can put
+        /// the outer variables back.
+        DenseMap<SymbolID, AllocaInst*> NamedValues;
+        SmallVector<std::pair<SymbolID, AllocaInst*>, 8> Shadowed;
 
-    BasicBlock* BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
+        std::unique_ptr<FunctionPassManager> TheFPM;
+        std::unique_ptr<FunctionPassManager> TheQuickFPM;  // For unoptimized definitions.
+        std::unique_ptr<FunctionPassManager> TheVectorizeFPM;
+        std::unique_ptr<LoopAnalysisManager> TheLAM;
+        std::unique_ptr<FunctionAnalysisManager> TheFAM;
+        std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+        std::unique_ptr<ModuleAnalysisManager> TheMAM;
+        std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+        std::unique_ptr<StandardInstrumentations> TheSI;
 
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    for(auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
+        PhaseTimers* Timers;    // Null unless this CodeGen's phases are timed.
+        bool MapWrappers = EmitMapWrappers;
 
-    if(Value* RetVal = Body->codegen()){
-        // Finish off the function.
-        Builder->CreateRet(RetVal);
+        /// TargetCPU/TargetFeatures - What the code is compiled for, given to every
+        /// function so the backend and the cost models use all of the target's ISA.
+        std::string TargetCPU;
+        std::string TargetFeatures;
 
-        // Validate the generated code, checking for consistency.
-        verifyFunction(*TheFunction);
+        /// CodeGen - PassTimer, if given, times every pass run on the module. Like
+        /// Timers it must not be shared with a CodeGen on another thread.
+        CodeGen(const SymbolTable& Symbols, const PrototypeMap& FunctionProtos, const DataLayout& DL,
+                const Triple& TT, TargetMachine* TM, PhaseTimers* Timers = nullptr,
+                TimePassesHandler* PassTimer = nullptr);
 
-        return TheFunction;
+        CodeGen(const CodeGen&) = delete;
+        CodeGen& operator=(const CodeGen&) = delete;
+
+        ~CodeGen(){
+            delete SpareFunction;
+        }
+
+        Function* getFunction(SymbolID Name);
+
+        /// createFunction - A new external function in the module, made out of the
+        /// spare function if that is one of the same type and name.
+        Function* createFunction(FunctionType* FT, StringRef Name);
+
+        /// recycleFunction - Take F, a function nothing refers to any more, out of
+        /// the module and keep it for createFunction.
+        void recycleFunction(Function* F);
+
+        /// beginFunctionBody - Give F, which holds code of the definition DefName, the
+        /// target's attributes and the -fast-math function attributes, and have the
+        /// builder put DefName's fast-math flags on the operations that follow.
+        void beginFunctionBody(Function& F, StringRef DefName);
+
+        /// getType - The LLVM type values of type Ty are held in.
+        Type* getType(ValueType Ty){
+            switch(Ty){
+                case vt_f32:
+                    return Builder->getFloatTy();
+                case vt_i64:
+                    return Builder->getInt64Ty();
+                default:
+                    return Builder->getDoubleTy();
+            }
+        }
+
+        /// getCommonType - The type L and R are both converted to when they meet in
+        /// an operation or a phi: the wider of the two, in the order i1, i64, f32,
+        /// f64. A constant takes the other type instead if it fits, which any number
+        /// does for an f32 and a whole number for an i64, so "n + 1" stays an i64.
+        Type* getCommonType(Value* L, Value* R);
+
+        /// convert - V as a value of type To. i1 is 0 or 1, and floating point values
+        /// are rounded toward zero for an i64, saturating, with NaN giving 0.
+        Value* convert(Value* V, Type* To);
+
+        /// createCondition - Whether V, of any type, is non-zero, as an i1.
+        Value* createCondition(Value* V, const Twine& Name);
+
+        /// createCall - Call F, converting the arguments to the types it takes. A
+        /// call of the function being emitted is a tail call: only numbers are ever
+        /// passed, so no callee can see the caller's frame, and marking the
+        /// self-calls lets TailCallElim turn them into loops.
+        CallInst* createCall(Function* F, ArrayRef<Value*> Args, const Twine& Name){
+            SmallVector<Value*, 8> Converted;
+            for(unsigned Idx = 0, E = Args.size(); Idx != E; ++Idx)
+                Converted.push_back(convert(Args[Idx], F->getFunctionType()->getParamType(Idx)));
+            CallInst* Call = Builder->CreateCall(F, Converted, Name);
+            if(F == Builder->GetInsertBlock()->getParent())
+                Call->setTailCall();
+            return Call;
+        }
+
+        /// createEntryBlockAlloca - A stack slot of type Ty for variable Name in the
+        /// entry block of the function being emitted, where mem2reg can promote it.
+        AllocaInst* createEntryBlockAlloca(SymbolID Name, Type* Ty){
+            BasicBlock& Entry = Builder->GetInsertBlock()->getParent()->getEntryBlock();
+            IRBuilder<> TmpB(&Entry, Entry.begin());
+            return TmpB.CreateAlloca(Ty, nullptr, Symbols.getName(Name));
+        }
+
+        /// createVariable - A stack slot for variable Name holding V, of type Ty or,
+        /// for vt_infer, of V's own type, with an i1 widened to an f64.
+        AllocaInst* createVariable(SymbolID Name, ValueType Ty, Value* V){
+            Type* SlotTy = Ty == vt_infer ? V->getType() : getType(Ty);
+            if(SlotTy->isIntegerTy(1))
+                SlotTy = Builder->getDoubleTy();
+            AllocaInst* Slot = createEntryBlockAlloca(Name, SlotTy);
+            Builder->CreateStore(convert(V, SlotTy), Slot);
+            return Slot;
+        }
+
+        /// bindVariable - Make Name refer to Slot until the scope is left.
+        void bindVariable(SymbolID Name, AllocaInst* Slot){
+            Shadowed.push_back({Name, NamedValues.lookup(Name)});
+            NamedValues[Name] = Slot;
+        }
+
+        /// leaveScope - Undo every binding made since Shadowed had Mark entries.
+        void leaveScope(size_t Mark){
+            while(Shadowed.size() > Mark){
+                auto Binding = Shadowed.pop_back_val();
+                if(Binding.second)
+                    NamedValues[Binding.first] = Binding.second;
+                else
+                    NamedValues.erase(Binding.first);
+            }
+        }
+
+        /// bindArguments - Start a function's scope with only its parameters, stored
+        /// from Values into fresh stack slots of the parameters' types.
+        void bindArguments(const PrototypeAST& P, ArrayRef<Value*> Values);
+
+        /// takeModule - Hand the finished module, together with its context, to the
+        /// JIT and carry on with an empty one, in the same context until that has
+        /// had -context-modules modules.
+        ThreadSafeModule takeModule(){
+            ThreadSafeContext Ctx = TSCtx;
+            return ThreadSafeModule(swapModule(), std::move(Ctx));
+        }
+
+        /// startModule - Drop the module being emitted for an empty one.
+        void startModule(){
+            ThreadSafeContext Ctx = TSCtx;  // Outlives the dropped module.
+            swapModule();
+        }
+
+    private:
+        /// startContext - Emit into a new context from now on, set up like the last
+        /// one. Each module handed out keeps its own context alive for as long as
+        /// it needs it.
+        void startContext();
+
+        /// swapModule - Put an empty module in place of TheModule and return the old
+        /// one. The builder, the pass managers and the context stay for the new
+        /// module; only the analyses go, as they are of the old module's functions.
+        /// Every -context-modules modules the context goes too, and the new module
+        /// is started in a fresh one.
+        std::unique_ptr<Module> swapModule(){
+            Builder->ClearInsertionPoint();
+            TheLAM->clear();
+            TheFAM->clear();
+            TheCGAM->clear();
+            TheMAM->clear();
+
+            if(ContextModules && ++ModulesInContext >= ContextModules){
+                delete SpareFunction;
+                SpareFunction = nullptr;
+                startContext();
+            }
+
+            auto NewModule = std::make_unique<Module>(TheModule->getModuleIdentifier(), *TheContext);
+            NewModule->setDataLayout(TheModule->getDataLayout());
+            NewModule->setTargetTriple(TheModule->getTargetTriple());
+            std::swap(TheModule, NewModule);
+            return NewModule;
+        }
+};
+
+CodeGen::CodeGen(const SymbolTable& Symbols, const PrototypeMap& FunctionProtos, const DataLayout& DL,
+                 const Triple& TT, TargetMachine* TM, PhaseTimers* Timers, TimePassesHandler* PassTimer)
+    : Symbols(Symbols), FunctionProtos(FunctionProtos), Timers(Timers){
+    if(TM){
+        TargetCPU = TM->getTargetCPU().str();
+        TargetFeatures = TM->getTargetFeatureString().str();
     }
 
-    // Error reading body, remove function.
-    TheFunction->eraseFromParent();
+    // Open a new context and module.
+    startContext();
+    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    TheModule->setDataLayout(DL);
+    TheModule->setTargetTriple(TT.str());
+
+    // Create new pass and analysis managers.
+    TheFPM = std::make_unique<FunctionPassManager>();
+    TheQuickFPM = std::make_unique<FunctionPassManager>();
+    TheVectorizeFPM = std::make_unique<FunctionPassManager>();
+    TheLAM = std::make_unique<LoopAnalysisManager>();
+    TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<ModuleAnalysisManager>();
+    ThePIC = std::make_unique<PassInstrumentationCallbacks>();
+    TheSI = std::make_unique<StandardInstrumentations>(/*DebugLogging*/ false);
+    TheSI->registerCallbacks(*ThePIC, TheFAM.get());
+    if(PassTimer)
+        PassTimer->registerCallbacks(*ThePIC);
+    if(TimeTrace)
+        registerTimeTraceCallbacks(*ThePIC);
+
+    // Register analysis passes used in these transform passes and cross-register
+    // the proxies between the managers.
+    PassBuilder PB(TM, PipelineTuningOptions(), None, ThePIC.get());
+    PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
+    PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
+    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+    addOptimizationPasses(*TheFPM, PB);
+    addQuickPasses(*TheQuickFPM);
+    addVectorizationPasses(*TheVectorizeFPM);
+}
+
+Function* CodeGen::createFunction(FunctionType* FT, StringRef Name){
+    if(SpareFunction && SpareFunction->getFunctionType() == FT && SpareFunction->getName() == Name){
+        Function* F = SpareFunction;
+        SpareFunction = nullptr;
+        TheModule->getFunctionList().push_back(F);
+        return F;
+    }
+    return Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+}
+
+void CodeGen::recycleFunction(Function* F){
+    // The next function may well be allocated at the same address, so the analyses
+    // cached for this one go in any case.
+    TheFAM->clear(*F, F->getName());
+    F->deleteBody();
+    F->setAttributes(AttributeList());
+    F->removeFromParent();
+    delete SpareFunction;
+    SpareFunction = F;
+}
+
+Value* LogErrorV(const char* Str){
+    LogError(Str);
     return nullptr;
 }
 
-//------------------------------------------------------------------------------------------------------//
-// End of code generation
-//------------------------------------------------------------------------------------------------------//
+/// getFunction - Every function lives in the module it was defined in, so once
+/// that module has been handed to the JIT later modules need a fresh declaration.
+/// Re-emit one from the recorded prototype when the current module lacks it.
+Function* CodeGen::getFunction(SymbolID Name){
+    // First, see if the function has already been added to the current module.
+    if(auto* F = TheModule->getFunction(Symbols.getName(Name)))
+        return F;
 
-//------------------------------------------------------------------------------------------------------//
-// Top-Level parsing
-//------------------------------------------------------------------------------------------------------//
+    // If not, check whether we can codegen the declaration from some existing prototype.
+    auto FI = FunctionProtos.find(Name);
+    if(FI != FunctionProtos.end())
+        return FI->second->codegen(*this);
 
-static void InitializeModule(){
-    // Open a new context and module.
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+void CodeGen::beginFunctionBody(Function& F, StringRef DefName){
+    if(!TargetCPU.empty())
+        F.addFnAttr("target-cpu", TargetCPU);
+    if(!TargetFeatures.empty())
+        F.addFnAttr("target-features", TargetFeatures);
+
+    // The backend reads the whole-function counterparts of the flags.
+    FastMathFlags FMF = getFastMathFlags(DefName);
+    if(FMF.noNaNs())
+        F.addFnAttr("no-nans-fp-math", "true");
+    if(FMF.noInfs())
+        F.addFnAttr("no-infs-fp-math", "true");
+    if(FMF.noSignedZeros())
+        F.addFnAttr("no-signed-zeros-fp-math", "true");
+    if(FMF.approxFunc())
+        F.addFnAttr("approx-func-fp-math", "true");
+    if(FMF.isFast())
+        F.addFnAttr("unsafe-fp-math", "true");
+    Builder->setFastMathFlags(FMF);
+}
+
+void CodeGen::startContext(){
+    auto Ctx = std::make_unique<LLVMContext>();
+    Ctx->setDiscardValueNames(DiscardValueNames);
+    if(TheContext)
+        Ctx->setDiagnosticHandlerCallBack(TheContext->getDiagnosticHandlerCallBack(),
+                                          TheContext->getDiagnosticContext());
+    TSCtx = ThreadSafeContext(std::move(Ctx));
+    TheContext = TSCtx.getContext();
+    ModulesInContext = 0;
 
-    //Create a new builder for the module.
+    //Create a new builder for the context.
     Builder = std::make_unique<IRBuilder<> >(*TheContext);
+    ++NumContexts;
 }
 
+void CodeGen::bindArguments(const PrototypeAST& P, ArrayRef<Value*> Values){
+    NamedValues.clear();
+    Shadowed.clear();
+    for(unsigned Idx = 0, E = Values.size(); Idx != E; ++Idx)
+        NamedValues[P.getArgs()[Idx]] = createVariable(P.getArgs()[Idx], P.getArgTypes()[Idx], Values[Idx]);
+}
 
-static void HandleDefinition(){
-    if(auto FnAST = ParseDefinition()){
-        if(auto* FnIR = FnAST->codegen()){
-            std::cout << "Parsed a function definition:" << std::endl;
-            FnIR->print(errs());
-            std::cout << std::endl;
-        }
-    }else{
-        // Skip token for error recovery.
-        getNextToken();
-    }
+/// getTypeRank - Where Ty stands in the order getCommonType widens in.
+static unsigned getTypeRank(Type* Ty){
+    if(Ty->isIntegerTy(1))
+        return 0;
+    if(Ty->isIntegerTy())
+        return 1;
+    return Ty->isFloatTy() ? 2 : 3;
 }
 
-static void HandleExtern(){
-    if(auto ProtoAST = ParseExtern()){
-        if(auto* FnIR = ProtoAST->codegen()){
-            std::cout << "Parsed an extern:" << std::endl;
-            FnIR->print(errs());
-            std::cout << std::endl;
-        }
-    }else{
-        // Skip token for error recovery
-        getNextToken();
-    }
+/// fitsType - Whether the constant C can take type Ty in getCommonType.
+static bool fitsType(Value* C, Type* Ty){
+    auto* CFP = dyn_cast<ConstantFP>(C);
+    if(!CFP || Ty->isIntegerTy(1))
+        return false;
+    if(Ty->isFloatingPointTy())
+        return true;
+    APSInt Int(64, /*isUnsigned*/ false);
+    bool IsExact;
+    return CFP->getValueAPF().convertToInteger(Int, APFloat::rmTowardZero, &IsExact) == APFloat::opOK && IsExact;
 }
 
-static void HandleTopLevelExpression(){
-    // Evaluate a top-level expression into an anonymous function.
-    if(auto FnAST = ParseTopLevelExpr()){
-        if(auto* FnIR = FnAST->codegen()){
-            std::cout << "Parsed a top-level expression:" << std::endl;
-            FnIR->print(errs());
-            std::cout << std::endl;
+Type* CodeGen::getCommonType(Value* L, Value* R){
+    Type* LTy = L->getType();
+    Type* RTy = R->getType();
+    if(LTy == RTy)
+        return LTy;
+    if(fitsType(R, LTy))
+        return LTy;
+    if(fitsType(L, RTy))
+        return RTy;
+    return getTypeRank(LTy) > getTypeRank(RTy) ? LTy : RTy;
+}
 
-            // Remove the anonymous expression.
-            FnIR->eraseFromParent();
+Value* CodeGen::convert(Value* V, Type* To){
+    Type* From = V->getType();
+    if(From == To)
+        return V;
+    if(To->isIntegerTy(1))
+        return createCondition(V, "tobool");
+    if(From->isIntegerTy(1))
+        return To->isIntegerTy() ? Builder->CreateZExt(V, To, "booltmp") : Builder->CreateUIToFP(V, To, "booltmp");
+    if(From->isIntegerTy())
+        return Builder->CreateSIToFP(V, To, "tofp");
+    if(To->isIntegerTy()){
+        // fptosi would be poison for NaNs and anything out of range.
+        if(auto* C = dyn_cast<ConstantFP>(V)){
+            APSInt Int(To->getIntegerBitWidth(), /*isUnsigned*/ false);
+            bool IsExact;
+            C->getValueAPF().convertToInteger(Int, APFloat::rmTowardZero, &IsExact);
+            return ConstantInt::get(To, Int);
         }
-    }else{
-        // Skip token for error recovery.
-        getNextToken();
+        return Builder->CreateIntrinsic(Intrinsic::fptosi_sat, {To, From}, {V}, nullptr, "toint");
     }
+    if(To->getPrimitiveSizeInBits() > From->getPrimitiveSizeInBits())
+        return Builder->CreateFPExt(V, To, "fpext");
+    return Builder->CreateFPTrunc(V, To, "fptrunc");
 }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop(){
-    while(true){
-        switch(CurTok){
-            case tok_eof:
-                return;
-            case ';': // ignore top-level semicolons.
-                std::cout << "ready> ";
-                getNextToken();
-                break;
-            case tok_def:
-                HandleDefinition();
-                break;
-            case tok_extern:
-                HandleExtern();
-                break;
-            default:
-                HandleTopLevelExpression();
-                break;
+Value* CodeGen::createCondition(Value* V, const Twine& Name){
+    Type* Ty = V->getType();
+    if(Ty->isIntegerTy(1))
+        return V;
+    if(Ty->isIntegerTy())
+        return Builder->CreateICmpNE(V, ConstantInt::get(Ty, 0), Name);
+    return Builder->CreateFCmpONE(V, ConstantFP::get(Ty, 0.0), Name);
+}
+
+Value* ExprAST::codegen(CodeGen& CG){
+    /// PendingNode - A node whose operands are still being emitted; Next is the
+    /// first one that isn't yet, and the values of the others start at FirstValue.
+    struct PendingNode{
+        ExprAST* Node;
+        ArrayRef<ExprAST*> Operands;
+        size_t Next;
+        size_t FirstValue;
+        EmitState State;
+    };
+    SmallVector<PendingNode, 16> Work;
+    SmallVector<Value*, 16> Values;  // Values of finished operands, innermost last.
+
+    Work.push_back({this, getOperands(), 0, 0, {}});
+    while(!Work.empty()){
+        PendingNode& Top = Work.back();
+        ArrayRef<Value*> Done = makeArrayRef(Values).drop_front(Top.FirstValue);
+        if(Top.Next != Top.Operands.size()){
+            if(!Top.Node->beginOperand(CG, Top.Next, Done, Top.State))
+                return nullptr;
+            ExprAST* Operand = Top.Operands[Top.Next++];
+            Work.push_back({Operand, Operand->getOperands(), 0, Values.size(), {}});
+            continue;
         }
+
+        Value* V = Top.Node->emit(CG, Done, Top.State);
+        if(!V)
+            return nullptr;
+        Values.truncate(Top.FirstValue);
+        Values.push_back(V);
+        Work.pop_back();
     }
+    return Values.back();
 }
 
-//------------------------------------------------------------------------------------------------------//
-// End of top-level parsing
-//------------------------------------------------------------------------------------------------------//
+Value* NumberExprAST::emit(CodeGen& CG, ArrayRef<Value*> /*Operands*/, EmitState& /*State*/){
+    return ConstantFP::get(*CG.TheContext, APFloat(Val));
+}
 
-//------------------------------------------------------------------------------------------------------//
-// Main driver code.
-//------------------------------------------------------------------------------------------------------//
+Value* VariableExprAST::emit(CodeGen& CG, ArrayRef<Value*> /*Operands*/, EmitState& /*State*/){
+    // Look this variable up in the function.
+    // Use lookup so a miss doesn't leave a null entry behind.
+    AllocaInst* Slot = CG.NamedValues.lookup(Name);
+    if(!Slot)
+        return LogErrorV("Unknown variable name");
 
-int main(int argc, char* argv[]){
-    // Install standard binary operators.
-    // 1 is lowest precedence.
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40;
-    BinopPrecedence['/'] = 40; // highest.
-
-    // Prime the first token.
-    std::cout << "ready> ";
-    getNextToken();
-
-    // Make the module, which holds all the code.
-    InitializeModule();
+    // Load the value.
+    return CG.Builder->CreateLoad(Slot->getAllocatedType(), Slot, CG.Symbols.getName(Name));
+}
 
-    // run the main "interpreter loop" now.
-    MainLoop();
+Value* UnaryExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& /*State*/){
+    Function* F = CG.getFunction(Fn);
+    if(!F)
+        return LogErrorV("Unknown unary operator");
+
+    return CG.createCall(F, Operands, "unop");
+}
+
+/// createSDiv - L / R on i64s, rounded toward zero. Dividing by zero gives 0 and
+/// INT64_MIN / -1 wraps around, rather than either trapping.
+static Value* createSDiv(IRBuilder<>& B, Value* L, Value* R){
+    Type* Ty = L->getType();
+    Value* Zero = ConstantInt::get(Ty, 0);
+    Value* IsZero = B.CreateICmpEQ(R, Zero, "divzero");
+    Value* Overflows = B.CreateAnd(B.CreateICmpEQ(L, ConstantInt::get(Ty, APInt::getSignedMinValue(64))),
+                                   B.CreateICmpEQ(R, ConstantInt::getSigned(Ty, -1)), "divoverflow");
+    Value* Divisor = B.CreateSelect(B.CreateOr(IsZero, Overflows), ConstantInt::get(Ty, 1), R, "divisor");
+    return B.CreateSelect(IsZero, Zero, B.CreateSDiv(L, Divisor, "divtmp"));
+}
+
+Value* BinaryExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& /*State*/){
+    Value* L = Operands[0];
+    Value* R = Operands[1];
 
-    // Print out all of the generated code.
-    TheModule->print(errs(), nullptr);
+    if(isBuiltinBinaryOp(Op)){
+        // Arithmetic on two comparisons is done on their values as f64s.
+        Type* Ty = CG.getCommonType(L, R);
+        if(Ty->isIntegerTy(1))
+            Ty = CG.Builder->getDoubleTy();
+        L = CG.convert(L, Ty);
+        R = CG.convert(R, Ty);
+
+        IRBuilder<>& B = *CG.Builder;
+        if(Ty->isIntegerTy()){
+            switch(Op){
+                case '+':
+                    return B.CreateAdd(L, R, "addtmp");
+                case '-':
+                    return B.CreateSub(L, R, "subtmp");
+                case '*':
+                    return B.CreateMul(L, R, "multmp");
+                case '/':
+                    return createSDiv(B, L, R);
+                default:
+                    return B.CreateICmpSLT(L, R, "cmptmp");
+            }
+        }
+
+        switch(Op){
+            case '+':
+                return B.CreateFAdd(L, R, "addtmp");
+            case '-':
+                return B.CreateFSub(L, R, "subtmp");
+            case '*':
+                return B.CreateFMul(L, R, "multmp");
+            case '/':
+                return B.CreateFDiv(L, R, "divtmp");
+            default:
+                return B.CreateFCmpULT(L, R, "cmptmp");
+        }
+    }
+
+    // If it wasn't a builtin binary operator, it must be a user defined one. Emit
+    // a call to it.
+    Function* F = Fn == sym_none ? nullptr : CG.getFunction(Fn);
+    if(!F)
+        return LogErrorV("invalid binary operator");
+
+    return CG.createCall(F, Operands, "binop");
+}
+
+Value* CallExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& /*State*/){
+    // Look up the name in the global module table.
+    Function* CalleeF = CG.getFunction(Callee);
+    if(!CalleeF)
+        return LogErrorV("Unknown function referenced");
+
+    // If argument mismatch error.
+    if(CalleeF->arg_size() != Operands.size())
+        return LogErrorV("Incorrect # arguments passed");
+
+    return CG.createCall(CalleeF, Operands, "calltmp");
+}
+
+bool IfExprAST::beginOperand(CodeGen& CG, unsigned Idx, ArrayRef<Value*> Done, EmitState& State){
+    BasicBlock*& ElseBB = State.Blocks[0];
+    BasicBlock*& MergeBB = State.Blocks[1];
+    BasicBlock*& ThenEndBB = State.Blocks[2];
+
+    if(Idx == 1){
+        // Convert the condition to a bool by comparing non-equal to 0.
+        Value* CondV = CG.createCondition(Done[0], "ifcond");
+
+        Function* TheFunction = CG.Builder->GetInsertBlock()->getParent();
+        BasicBlock* ThenBB = BasicBlock::Create(*CG.TheContext, "then", TheFunction);
+        ElseBB = BasicBlock::Create(*CG.TheContext, "else", TheFunction);
+        MergeBB = BasicBlock::Create(*CG.TheContext, "ifcont", TheFunction);
+        CG.Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+        CG.Builder->SetInsertPoint(ThenBB);
+    }else if(Idx == 2){
+        // The then value may have been computed in a block further on than ThenBB.
+        // Its branch to MergeBB waits for the else value, which may change its type.
+        ThenEndBB = CG.Builder->GetInsertBlock();
+        CG.Builder->SetInsertPoint(ElseBB);
+    }
+    return true;
+}
+
+Value* IfExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State){
+    BasicBlock* MergeBB = State.Blocks[1];
+    BasicBlock* ThenEndBB = State.Blocks[2];
+    BasicBlock* ElseEndBB = CG.Builder->GetInsertBlock();
+    Type* Ty = CG.getCommonType(Operands[1], Operands[2]);
+
+    Value* ElseV = CG.convert(Operands[2], Ty);
+    CG.Builder->CreateBr(MergeBB);
+
+    CG.Builder->SetInsertPoint(ThenEndBB);
+    Value* ThenV = CG.convert(Operands[1], Ty);
+    CG.Builder->CreateBr(MergeBB);
+
+    CG.Builder->SetInsertPoint(MergeBB);
+    PHINode* PN = CG.Builder->CreatePHI(Ty, 2, "iftmp");
+    PN->addIncoming(ThenV, ThenEndBB);
+    PN->addIncoming(ElseV, ElseEndBB);
+    return PN;
+}
+
+// Output for-loop as:
+//   var = alloca double
+//   ...
+//   start = startexpr
+//   store start -> var
+//   br loop
+// loop:
+//   ...
+//   bodyexpr
+//   ...
+//   step = stepexpr
+//   endcond = endexpr
+//   curvar = load var
+//   nextvar = curvar + step
+//   store nextvar -> var
+//   br endcond, loop, afterloop
+// afterloop:
+bool ForExprAST::beginOperand(CodeGen& CG, unsigned Idx, ArrayRef<Value*> Done, EmitState& State){
+    if(Idx != 1)
+        return true;
+
+    // Start is done, store it in the variable's slot. The loop begins with the body.
+    State.Slot = CG.createVariable(VarName, VarType, Done[0]);
+
+    BasicBlock* LoopBB = BasicBlock::Create(*CG.TheContext, "loop", CG.Builder->GetInsertBlock()->getParent());
+    CG.Builder->CreateBr(LoopBB);
+    CG.Builder->SetInsertPoint(LoopBB);
+    State.Blocks[0] = LoopBB;
+
+    // Within the loop the variable shadows any existing one by the same name.
+    State.ScopeMark = CG.Shadowed.size();
+    CG.bindVariable(VarName, State.Slot);
+    return true;
+}
+
+Value* ForExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State){
+    LLVMContext& Ctx = *CG.TheContext;
+    Type* VarTy = State.Slot->getAllocatedType();
+    Value* StepV = CG.convert(hasStep() ? Operands[2] : ConstantFP::get(Ctx, APFloat(1.0)), VarTy);
+
+    // Reload, increment, and restore the variable, in case the body or the end
+    // condition assigned to it.
+    Value* CurVar = CG.Builder->CreateLoad(VarTy, State.Slot, CG.Symbols.getName(VarName));
+    Value* NextVar = VarTy->isIntegerTy() ? CG.Builder->CreateAdd(CurVar, StepV, "nextvar")
+                                          : CG.Builder->CreateFAdd(CurVar, StepV, "nextvar");
+    CG.Builder->CreateStore(NextVar, State.Slot);
+
+    // Convert the end condition to a bool by comparing non-equal to 0.
+    Value* EndCond = CG.createCondition(Operands.back(), "loopcond");
+
+    BasicBlock* AfterBB = BasicBlock::Create(Ctx, "afterloop", CG.Builder->GetInsertBlock()->getParent());
+    CG.Builder->CreateCondBr(EndCond, State.Blocks[0], AfterBB);
+    CG.Builder->SetInsertPoint(AfterBB);
+
+    // Restore the unshadowed variable.
+    CG.leaveScope(State.ScopeMark);
+
+    // for expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(Ctx));
+}
+
+bool VarExprAST::beginOperand(CodeGen& CG, unsigned Idx, ArrayRef<Value*> Done, EmitState& State){
+    if(Idx == 0){
+        State.ScopeMark = CG.Shadowed.size();
+        return true;
+    }
+
+    // Initializer Idx - 1 is done, bind its variable before anything after it is
+    // emitted. This is what makes "var a = 1, b = a in" work.
+    CG.bindVariable(VarNames[Idx - 1], CG.createVariable(VarNames[Idx - 1], VarTypes[Idx - 1], Done[Idx - 1]));
+    return true;
+}
+
+Value* VarExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& State){
+    // Pop all our variables from scope, the body's value is the result.
+    CG.leaveScope(State.ScopeMark);
+    return Operands.back();
+}
+
+Value* AssignExprAST::emit(CodeGen& CG, ArrayRef<Value*> Operands, EmitState& /*State*/){
+    AllocaInst* Slot = CG.NamedValues.lookup(VarName);
+    if(!Slot)
+        return LogErrorV("Unknown variable name");
+
+    Value* V = CG.convert(Operands[0], Slot->getAllocatedType());
+    CG.Builder->CreateStore(V, Slot);
+    return V;
+}
+
+Function* PrototypeAST::codegen(CodeGen& CG) const{
+    // Make the function type: double(double, i64) etc.
+    std::vector<Type*> Params;
+    for(ValueType Ty : ArgTypes)
+        Params.push_back(CG.getType(Ty));
+    FunctionType* FT = FunctionType::get(CG.getType(ReturnType), Params, false);
+    Function* F = CG.createFunction(FT, Name);
+
+    // Set names for all arguments.
+    if(!CG.TheContext->shouldDiscardValueNames()){
+        unsigned Idx = 0;
+        for(auto &Arg : F->args())
+            Arg.setName(CG.Symbols.getName(Args[Idx++]));
+    }
+
+    // A definition named like a C library function (def sin(x) ...) is ours, so
+    // LLVM mustn't fold or replace calls to it as the library function.
+    if(Definition)
+        F->addFnAttr(Attribute::NoBuiltin);
+
+    // Declarations of definitions from other modules carry what is known about them.
+    if(ReadNone)
+        F->setDoesNotAccessMemory();
+    if(NoUnwind)
+        F->setDoesNotThrow();
+    // Only a function that is sure to return can have a call with an unused
+    // result deleted. Definitions may loop forever, so only libm gets this.
+    if(WillReturn){
+        F->setWillReturn();
+        F->setDoesNotFreeMemory();
+        F->setNoSync();
+    }
+
+    return F;
+}
+
+/// FunctionAST::codegen - Emit the definition into CG's module and run the function
+/// passes over it, or only the quick ones if not to Optimize. It is up to the
+/// caller to record the prototype in FunctionProtos once this succeeds.
+Function* FunctionAST::codegen(CodeGen& CG, bool Optimize){
+    // First, check for an existing function from a previous 'extern' declaration
+    // or call in this module.
+    auto& P = *Proto;
+    PhaseScope Phase(CG.Timers, phase_irgen, P.getName());
+    Function* TheFunction = CG.TheModule->getFunction(P.getName());
+
+    // Callers compiled against an extern or an earlier definition pass what it
+    // takes, a new body has to take the same.
+    auto FI = CG.FunctionProtos.find(P.getSymbol());
+    if(TheFunction && TheFunction->arg_size() != P.getArgs().size())
+        return (Function*)LogErrorV("Function redefined with a different number of arguments");
+    if(FI != CG.FunctionProtos.end())
+        if(const char* Err = checkRedefinition(*FI->second, P))
+            return (Function*)LogErrorV(Err);
+
+    if(!TheFunction)
+        TheFunction = P.codegen(CG);
+
+    if(!TheFunction)
+        return nullptr;
+
+    if(!TheFunction->empty())
+        return (Function*)LogErrorV("Function cannot be redefined.");
+
+    BasicBlock* BB = BasicBlock::Create(*CG.TheContext, "entry", TheFunction);
+    CG.Builder->SetInsertPoint(BB);
+    CG.beginFunctionBody(*TheFunction, P.getName());
+
+    // Give every argument a stack slot and record it in the NamedValues map.
+    SmallVector<Value*, 8> Args;
+    for(auto &Arg : TheFunction->args())
+        Args.push_back(&Arg);
+    CG.bindArguments(P, Args);
+
+    if(Value* RetVal = Body->codegen(CG)){
+        // Finish off the function.
+        CG.Builder->CreateRet(CG.convert(RetVal, TheFunction->getReturnType()));
+
+        // Validate the generated code, checking for consistency.
+        Phase.switchTo(phase_verify);
+        verifyFunction(*TheFunction);
+
+        Phase.switchTo(phase_optimize);
+        inferAttributes(*TheFunction);
+
+        // Run the optimizer on the function.
+        (Optimize ? CG.TheFPM : CG.TheQuickFPM)->run(*TheFunction, *CG.TheFAM);
+        Phase.finish();
+
+        ++NumFunctions;
+        NumInstructions += TheFunction->getInstructionCount();
+
+        if(Memoize && P.isReadNone() && P.isNoUnwind() && P.getSymbol() != sym_anon_expr)
+            codegenMemo(CG, *TheFunction, Optimize);
+
+        if(CG.MapWrappers && P.getSymbol() != sym_anon_expr)
+            codegenMap(CG);
+
+        return TheFunction;
+    }
+
+    // Error reading body, remove function.
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+/// inferAttributes - Kaleidoscope code only computes with its arguments, so a
+/// definition is readnone (or nounwind) when every function it calls is too.
+/// Calls to itself don't count against it. What is found is recorded in the
+/// prototype so declarations in later modules get the same attributes.
+void FunctionAST::inferAttributes(Function& F){
+    bool ReadNone = true;
+    bool NoUnwind = true;
+    for(auto& I : instructions(F)){
+        auto* Call = dyn_cast<CallInst>(&I);
+        if(!Call)
+            continue;
+
+        Function* Callee = Call->getCalledFunction();
+        if(Callee == &F)
+            continue;
+        if(!Callee || !Callee->doesNotAccessMemory())
+            ReadNone = false;
+        if(!Callee || !Callee->doesNotThrow())
+            NoUnwind = false;
+    }
+
+    Proto->setAttributes(ReadNone, NoUnwind);
+    if(ReadNone)
+        F.setDoesNotAccessMemory();
+    if(NoUnwind)
+        F.setDoesNotThrow();
+}
+
+/// MemoGenerationName - The word -memoize caches are invalidated through.
+static const char* const MemoGenerationName = "kaleidoscope.memo.generation";
+
+/// codegenMemo - Put a direct mapped cache of results in front of F, a definition
+/// that only computes with its arguments. The body moves to an internal
+/// NAME.uncached and F becomes the wrapper that looks the arguments up first, so
+/// recursive calls, which still go to F, are cached too.
+///
+/// The cache is a cache line aligned table of entries holding the bits of the
+/// arguments, of the result, and a check word mixing the arguments' hash with the
+/// result. Map wrappers may call F from several threads at once, so every word
+/// is read and written atomically, but on its own; an entry torn by two writers
+/// fails the check and is taken for a miss.
+///
+/// A result also depends on the definitions of everything F calls, so the hash
+/// starts from MemoGenerationName, a word the session bumps with every new
+/// definition. Objects that aren't run by the JIT carry a weak copy of it.
+void FunctionAST::codegenMemo(CodeGen& CG, Function& F, bool Optimize){
+    auto& P = *Proto;
+    LLVMContext& Ctx = *CG.TheContext;
+    IRBuilder<>& B = *CG.Builder;
+    Type* WordTy = B.getInt64Ty();
+    unsigned NumArgs = F.arg_size();
+    PhaseScope Phase(CG.Timers, phase_irgen, F.getName());
+
+    Function* Body = Function::Create(F.getFunctionType(), Function::InternalLinkage, F.getName() + ".uncached",
+                                      CG.TheModule.get());
+    Body->copyAttributesFrom(&F);
+    Body->getBasicBlockList().splice(Body->end(), F.getBasicBlockList());
+    for(auto Args : zip(F.args(), Body->args())){
+        std::get<1>(Args).setName(std::get<0>(Args).getName());
+        std::get<0>(Args).replaceAllUsesWith(&std::get<1>(Args));
+    }
+
+    // In its own module the wrapper plainly writes memory. Everyone else keeps
+    // seeing it as readnone through the prototype, which the cache can't tell from.
+    F.removeFnAttr(Attribute::ReadNone);
+    Body->removeFnAttr(Attribute::ReadNone);
+
+    auto* Generation = CG.TheModule->getGlobalVariable(MemoGenerationName);
+    if(!Generation){
+        bool Standalone = CompileOnly && FileType != OFT_Library;
+        Generation = new GlobalVariable(*CG.TheModule, WordTy, /*isConstant*/ false,
+                                        Standalone ? GlobalValue::WeakAnyLinkage : GlobalValue::ExternalLinkage,
+                                        Standalone ? B.getInt64(0) : nullptr, MemoGenerationName);
+    }
+
+    // [Entries x [EntryWords x i64]], each entry holding Args..., Result, Check.
+    uint64_t Entries = PowerOf2Ceil(std::max(1u, (unsigned)MemoizeEntries));
+    uint64_t EntryWords = PowerOf2Ceil(NumArgs + 2);
+    ArrayType* TableTy = ArrayType::get(ArrayType::get(WordTy, EntryWords), Entries);
+    auto* Table = new GlobalVariable(*CG.TheModule, TableTy, /*isConstant*/ false, GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(TableTy), F.getName() + ".cache");
+    Table->setAlignment(Align(64));
+
+    BasicBlock* EntryBB = BasicBlock::Create(Ctx, "entry", &F);
+    BasicBlock* HitBB = BasicBlock::Create(Ctx, "hit", &F);
+    BasicBlock* MissBB = BasicBlock::Create(Ctx, "miss", &F);
+    B.SetInsertPoint(EntryBB);
+    CG.beginFunctionBody(F, P.getName());
+
+    // Every value fits in a word: f64s and f32s as their bits, i64s as they are.
+    auto toWord = [&](Value* V){
+        Type* Ty = V->getType();
+        if(Ty->isIntegerTy())
+            return V;
+        if(Ty->isFloatTy())
+            return B.CreateZExt(B.CreateBitCast(V, B.getInt32Ty()), WordTy);
+        return B.CreateBitCast(V, WordTy);
+    };
+    auto fromWord = [&](Value* Word, Type* Ty){
+        if(Ty->isIntegerTy())
+            return Word;
+        if(Ty->isFloatTy())
+            return B.CreateBitCast(B.CreateTrunc(Word, B.getInt32Ty()), Ty);
+        return B.CreateBitCast(Word, Ty);
+    };
+
+    SmallVector<Value*, 8> ArgBits;
+    LoadInst* CurrentGeneration = B.CreateAlignedLoad(WordTy, Generation, Align(8), "generation");
+    CurrentGeneration->setAtomic(AtomicOrdering::Unordered);
+    Value* Hash = B.CreateXor(CurrentGeneration, B.getInt64(0x243F6A8885A308D3));
+    for(Argument& Arg : F.args()){
+        ArgBits.push_back(toWord(&Arg));
+        Hash = B.CreateMul(B.CreateXor(Hash, ArgBits.back()), B.getInt64(0x9E3779B97F4A7C15));
+    }
+    Hash = B.CreateXor(Hash, B.CreateLShr(Hash, 29));
+    Value* Idx = B.CreateAnd(Hash, Entries - 1);
+
+    auto getWord = [&](unsigned Word){
+        return B.CreateInBoundsGEP(TableTy, Table, {B.getInt64(0), Idx, B.getInt64(Word)});
+    };
+    auto loadWord = [&](unsigned Word){
+        LoadInst* Load = B.CreateAlignedLoad(WordTy, getWord(Word), Align(8));
+        Load->setAtomic(AtomicOrdering::Unordered);
+        return Load;
+    };
+    auto storeWord = [&](Value* V, unsigned Word){
+        B.CreateAlignedStore(V, getWord(Word), Align(8))->setAtomic(AtomicOrdering::Unordered);
+    };
+    // Never 0, so an entry that was never written can't pass.
+    auto getCheck = [&](Value* ResultBits){
+        return B.CreateOr(B.CreateMul(B.CreateXor(Hash, ResultBits), B.getInt64(0xC2B2AE3D27D4EB4F)), B.getInt64(1));
+    };
+
+    Value* Hit = B.getTrue();
+    for(unsigned I = 0; I != NumArgs; ++I)
+        Hit = B.CreateAnd(Hit, B.CreateICmpEQ(loadWord(I), ArgBits[I]));
+    Value* CachedBits = loadWord(NumArgs);
+    Hit = B.CreateAnd(Hit, B.CreateICmpEQ(loadWord(NumArgs + 1), getCheck(CachedBits)), "hit");
+    B.CreateCondBr(Hit, HitBB, MissBB);
+
+    B.SetInsertPoint(HitBB);
+    B.CreateRet(fromWord(CachedBits, F.getReturnType()));
+
+    B.SetInsertPoint(MissBB);
+    SmallVector<Value*, 8> Args;
+    for(Argument& Arg : F.args())
+        Args.push_back(&Arg);
+    Value* Result = B.CreateCall(Body, Args, "result");
+    Value* ResultBits = toWord(Result);
+    for(unsigned I = 0; I != NumArgs; ++I)
+        storeWord(ArgBits[I], I);
+    storeWord(ResultBits, NumArgs);
+    storeWord(getCheck(ResultBits), NumArgs + 1);
+    B.CreateRet(Result);
+
+    Phase.switchTo(phase_verify);
+    verifyFunction(F);
+
+    Phase.switchTo(phase_optimize);
+    (Optimize ? CG.TheFPM : CG.TheQuickFPM)->run(F, *CG.TheFAM);
+    Phase.finish();
+
+    ++NumMemoized;
+    ++NumFunctions;
+    NumInstructions += F.getInstructionCount();
+}
+
+/// codegenMap - Emit the batch entry point for this definition,
+///     void NAME.map(const double* const* Columns, double* Out, uint64_t N)
+/// which sets Out[i] = NAME(Columns[0][i], Columns[1][i], ...) for every i < N.
+/// The columns are handed to an internal NAME.map.kernel that takes each one as
+/// a noalias argument and has the body emitted straight into its loop instead
+/// of a call, so the loop vectorizer sees the whole row computation.
+Function* FunctionAST::codegenMap(CodeGen& CG){
+    auto& P = *Proto;
+    LLVMContext& Ctx = *CG.TheContext;
+    Type* DoublePtrTy = Type::getDoublePtrTy(Ctx);
+    Type* SizeTy = Type::getInt64Ty(Ctx);
+    std::string Name = (P.getName() + ".map").str();
+    PhaseScope Phase(CG.Timers, phase_irgen, Name);
+
+    // void NAME.map.kernel(double* noalias Arg0, ..., double* noalias Out, i64 N)
+    std::vector<Type*> KernelParams(P.getArgs().size() + 1, DoublePtrTy);
+    KernelParams.push_back(SizeTy);
+    FunctionType* KernelFT = FunctionType::get(Type::getVoidTy(Ctx), KernelParams, false);
+    Function* Kernel = Function::Create(KernelFT, Function::InternalLinkage, Name + ".kernel", CG.TheModule.get());
+    for(auto& Arg : Kernel->args())
+        if(Arg.getType()->isPointerTy())
+            Arg.addAttr(Attribute::NoAlias);
+
+    Value* Out = Kernel->getArg(P.getArgs().size());
+    Value* N = Kernel->getArg(P.getArgs().size() + 1);
+
+    BasicBlock* EntryBB = BasicBlock::Create(Ctx, "entry", Kernel);
+    BasicBlock* LoopBB = BasicBlock::Create(Ctx, "loop", Kernel);
+    BasicBlock* ExitBB = BasicBlock::Create(Ctx, "exit", Kernel);
+
+    CG.Builder->SetInsertPoint(EntryBB);
+    CG.beginFunctionBody(*Kernel, P.getName());
+    CG.Builder->CreateCondBr(CG.Builder->CreateICmpEQ(N, ConstantInt::get(SizeTy, 0), "empty"), ExitBB, LoopBB);
+
+    // Load this row's arguments and bind them to the parameter names.
+    CG.Builder->SetInsertPoint(LoopBB);
+    PHINode* Row = CG.Builder->CreatePHI(SizeTy, 2, "row");
+    Row->addIncoming(ConstantInt::get(SizeTy, 0), EntryBB);
+
+    SmallVector<Value*, 8> Args;
+    for(unsigned Idx = 0, E = P.getArgs().size(); Idx != E; ++Idx){
+        Value* Column = Kernel->getArg(Idx);
+        Value* Ptr = CG.Builder->CreateInBoundsGEP(Type::getDoubleTy(Ctx), Column, Row);
+        Args.push_back(CG.Builder->CreateLoad(Type::getDoubleTy(Ctx), Ptr, CG.Symbols.getName(P.getArgs()[Idx])));
+    }
+    CG.bindArguments(P, Args);
+
+    Value* RetVal = Body->codegen(CG);
+    if(!RetVal){
+        Kernel->eraseFromParent();
+        return nullptr;
+    }
+    // The columns and Out are doubles whatever the types, converted like a call would.
+    RetVal = CG.convert(CG.convert(RetVal, CG.getType(P.getReturnType())), Type::getDoubleTy(Ctx));
+    CG.Builder->CreateStore(RetVal, CG.Builder->CreateInBoundsGEP(Type::getDoubleTy(Ctx), Out, Row));
+
+    // The body may have ended in a different block than it started in.
+    Value* NextRow = CG.Builder->CreateNUWAdd(Row, ConstantInt::get(SizeTy, 1), "nextrow");
+    Row->addIncoming(NextRow, CG.Builder->GetInsertBlock());
+    BranchInst* Latch = CG.Builder->CreateCondBr(CG.Builder->CreateICmpEQ(NextRow, N, "done"), ExitBB, LoopBB);
+
+    // Ask for the loop to be vectorized: !{!self, !{"llvm.loop.vectorize.enable", i1 true}}
+    Metadata* Enable[] = {MDString::get(Ctx, "llvm.loop.vectorize.enable"),
+                          ConstantAsMetadata::get(CG.Builder->getTrue())};
+    Metadata* LoopOps[] = {nullptr, MDNode::get(Ctx, Enable)};
+    MDNode* LoopID = MDNode::getDistinct(Ctx, LoopOps);
+    LoopID->replaceOperandWith(0, LoopID);
+    Latch->setMetadata(LLVMContext::MD_loop, LoopID);
+
+    CG.Builder->SetInsertPoint(ExitBB);
+    CG.Builder->CreateRetVoid();
+
+    // void NAME.map(double** Columns, double* Out, i64 N)
+    Type* MapParams[] = {PointerType::getUnqual(DoublePtrTy), DoublePtrTy, SizeTy};
+    FunctionType* MapFT = FunctionType::get(Type::getVoidTy(Ctx), MapParams, false);
+    Function* Map = Function::Create(MapFT, Function::ExternalLinkage, Name, CG.TheModule.get());
+    Map->getArg(0)->setName("columns");
+    Map->getArg(1)->setName("out");
+    Map->getArg(2)->setName("n");
+
+    CG.Builder->SetInsertPoint(BasicBlock::Create(Ctx, "entry", Map));
+    CG.beginFunctionBody(*Map, P.getName());
+    std::vector<Value*> KernelArgs;
+    for(unsigned Idx = 0, E = P.getArgs().size(); Idx != E; ++Idx){
+        Value* Ptr = CG.Builder->CreateConstInBoundsGEP1_64(DoublePtrTy, Map->getArg(0), Idx);
+        KernelArgs.push_back(CG.Builder->CreateLoad(DoublePtrTy, Ptr, "column"));
+    }
+    KernelArgs.push_back(Map->getArg(1));
+    KernelArgs.push_back(Map->getArg(2));
+    CG.Builder->CreateCall(Kernel, KernelArgs);
+    CG.Builder->CreateRetVoid();
+
+    Phase.switchTo(phase_verify);
+    verifyFunction(*Kernel);
+    verifyFunction(*Map);
+
+    Phase.switchTo(phase_optimize);
+    CG.TheFPM->run(*Kernel, *CG.TheFAM);
+    CG.TheVectorizeFPM->run(*Kernel, *CG.TheFAM);
+    Phase.finish();
+
+    NumFunctions += 2;
+    NumInstructions += Kernel->getInstructionCount() + Map->getInstructionCount();
+    return Map;
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of code generation
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Object cache
+//------------------------------------------------------------------------------------------------------//
+
+/// Every node starts with a tag so trees of different shapes can't hash alike.
+enum HashTag : uint8_t {
+    hash_number,
+    hash_variable,
+    hash_unary,
+    hash_binary,
+    hash_call,
+    hash_prototype,
+    hash_if,
+    hash_for,
+    hash_var,
+    hash_assign
+};
+
+static void hashTag(MD5& Hash, HashTag Tag){
+    uint8_t Byte = Tag;
+    Hash.update(makeArrayRef(Byte));
+}
+
+static void hashInt(MD5& Hash, uint64_t V){
+    uint8_t Bytes[8];
+    support::endian::write64le(Bytes, V);
+    Hash.update(Bytes);
+}
+
+/// hashString - Strings are length prefixed, so "ab","c" and "a","bc" differ.
+static void hashString(MD5& Hash, StringRef S){
+    hashInt(Hash, S.size());
+    Hash.update(S);
+}
+
+/// HashContext - What node hashes look names and callees up in.
+struct HashContext{
+    const SymbolTable& Symbols;
+    const PrototypeMap& FunctionProtos;
+    SymbolID Self = sym_none;   // The definition being hashed, see hashCallee.
+};
+
+/// hashTypes - The argument and result types of P.
+static void hashTypes(MD5& Hash, const PrototypeAST& P){
+    for(ValueType Ty : P.getArgTypes())
+        hashInt(Hash, Ty);
+    hashInt(Hash, P.getReturnType());
+}
+
+/// hashCallee - A call's code depends on the attributes recorded for its callee
+/// as well as its name, since readnone calls can be hoisted and CSE'd, and on the
+/// types it converts the arguments and the result between. A definition's calls
+/// to itself are left at the name: what is recorded about it then depends on
+/// whether it was seen before, by this run or as a library function, and its
+/// types are hashed with its prototype anyway.
+static void hashCallee(MD5& Hash, const HashContext& Ctx, SymbolID Callee){
+    hashString(Hash, Ctx.Symbols.getName(Callee));
+    if(Callee == Ctx.Self)
+        return;
+    auto FI = Ctx.FunctionProtos.find(Callee);
+    bool ReadNone = FI != Ctx.FunctionProtos.end() && FI->second->isReadNone();
+    bool NoUnwind = FI != Ctx.FunctionProtos.end() && FI->second->isNoUnwind();
+    bool WillReturn = FI != Ctx.FunctionProtos.end() && FI->second->isWillReturn();
+    hashInt(Hash, WillReturn << 2 | ReadNone << 1 | NoUnwind);
+    if(FI != Ctx.FunctionProtos.end())
+        hashTypes(Hash, *FI->second);
+}
+
+void ExprAST::addToHash(MD5& Hash, const HashContext& Ctx) const{
+    // Hash in pre-order. A node's tag, and a call's argument count, say how many
+    // operands follow it, so the sequence identifies the tree.
+    SmallVector<const ExprAST*, 16> Work;
+    Work.push_back(this);
+    while(!Work.empty()){
+        const ExprAST* E = Work.pop_back_val();
+        E->hashNode(Hash, Ctx);
+        ArrayRef<ExprAST*> Operands = E->getOperands();
+        Work.append(Operands.rbegin(), Operands.rend());
+    }
+}
+
+void NumberExprAST::hashNode(MD5& Hash, const HashContext& /*Ctx*/) const{
+    hashTag(Hash, hash_number);
+    hashInt(Hash, APFloat(Val).bitcastToAPInt().getZExtValue());
+}
+
+void VariableExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_variable);
+    hashString(Hash, Ctx.Symbols.getName(Name));
+}
+
+void UnaryExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_unary);
+    hashCallee(Hash, Ctx, Fn);
+}
+
+void BinaryExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_binary);
+    hashInt(Hash, (unsigned char)Op);
+    hashCallee(Hash, Ctx, Fn);
+}
+
+void CallExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_call);
+    hashCallee(Hash, Ctx, Callee);
+    hashInt(Hash, Args.size());
+}
+
+void IfExprAST::hashNode(MD5& Hash, const HashContext& /*Ctx*/) const{
+    hashTag(Hash, hash_if);
+}
+
+void ForExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_for);
+    hashString(Hash, Ctx.Symbols.getName(VarName));
+    hashInt(Hash, VarType);
+    hashInt(Hash, hasStep());
+}
+
+void VarExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_var);
+    hashInt(Hash, VarNames.size());
+    for(unsigned Idx = 0, E = VarNames.size(); Idx != E; ++Idx){
+        hashString(Hash, Ctx.Symbols.getName(VarNames[Idx]));
+        hashInt(Hash, VarTypes[Idx]);
+    }
+}
+
+void AssignExprAST::hashNode(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_assign);
+    hashString(Hash, Ctx.Symbols.getName(VarName));
+}
+
+void PrototypeAST::addToHash(MD5& Hash, const HashContext& Ctx) const{
+    hashTag(Hash, hash_prototype);
+    hashString(Hash, Name);
+    hashInt(Hash, Args.size());
+    for(SymbolID Arg : Args)
+        hashString(Hash, Ctx.Symbols.getName(Arg));
+    hashTypes(Hash, *this);
+}
+
+void FunctionAST::addToHash(MD5& Hash, const HashContext& Ctx) const{
+    HashContext Definition{Ctx.Symbols, Ctx.FunctionProtos, Proto->getSymbol()};
+    Proto->addToHash(Hash, Definition);
+    Body->addToHash(Hash, Definition);
+}
+
+/// ObjectFileCache - Content addressed directory of compiled definitions. Each
+/// entry is the object file for one definition, named after its cache key.
+/// Failing to read or write the cache is never an error, the definition is
+/// simply compiled again.
+class ObjectFileCache{
+    private:
+        std::string Dir;
+
+        void getPath(StringRef Key, SmallVectorImpl<char>& Path) const{
+            sys::path::append(Path, Dir, Key + ".o");
+        }
+
+    public:
+        explicit ObjectFileCache(std::string Dir) : Dir(std::move(Dir)) {}
+
+        std::unique_ptr<MemoryBuffer> getObject(StringRef Key) const;
+        void storeObject(StringRef Key, MemoryBufferRef Obj) const;
+};
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getObject(StringRef Key) const{
+    SmallString<128> Path;
+    getPath(Key, Path);
+    auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+    if(!BufOrErr)
+        return nullptr;
+    return std::move(*BufOrErr);
+}
+
+/// storeObject - Write the entry under a temporary name and rename it into
+/// place, so other threads or processes never see half of it.
+void ObjectFileCache::storeObject(StringRef Key, MemoryBufferRef Obj) const{
+    if(std::error_code EC = sys::fs::create_directories(Dir)){
+        std::cerr << "Warning: could not create " << Dir << ": " << EC.message() << std::endl;
+        return;
+    }
+
+    SmallString<128> Path;
+    getPath(Key, Path);
+    auto Temp = sys::fs::TempFile::create(Path + ".tmp%%%%%%");
+    if(!Temp){
+        std::cerr << "Warning: could not write to the object cache: " << toString(Temp.takeError()) << std::endl;
+        return;
+    }
+
+    {
+        raw_fd_ostream OS(Temp->FD, /*shouldClose*/ false);
+        OS << Obj.getBuffer();
+    }
+
+    if(auto Err = Temp->keep(Path))
+        std::cerr << "Warning: could not write to the object cache: " << toString(std::move(Err)) << std::endl;
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of object cache
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Host functions
+//------------------------------------------------------------------------------------------------------//
+
+/// HostFunction - A C library function that externs of its name are bound to.
+struct HostFunction{
+    const char* Name;
+    unsigned NumArgs;
+    JITTargetAddress Address;
+};
+
+typedef double (*UnaryMathFn)(double);
+typedef double (*BinaryMathFn)(double, double);
+
+/// getHostFunctions - The libm functions bound explicitly in the JIT, rather than
+/// left to whatever the process happens to export.
+static ArrayRef<HostFunction> getHostFunctions(){
+    static const HostFunction Functions[] = {
+        {"sin", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::sin))},
+        {"cos", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::cos))},
+        {"tan", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::tan))},
+        {"asin", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::asin))},
+        {"acos", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::acos))},
+        {"atan", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::atan))},
+        {"atan2", 2, pointerToJITTargetAddress(static_cast<BinaryMathFn>(&::atan2))},
+        {"sinh", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::sinh))},
+        {"cosh", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::cosh))},
+        {"tanh", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::tanh))},
+        {"exp", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::exp))},
+        {"exp2", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::exp2))},
+        {"log", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::log))},
+        {"log2", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::log2))},
+        {"log10", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::log10))},
+        {"pow", 2, pointerToJITTargetAddress(static_cast<BinaryMathFn>(&::pow))},
+        {"sqrt", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::sqrt))},
+        {"cbrt", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::cbrt))},
+        {"hypot", 2, pointerToJITTargetAddress(static_cast<BinaryMathFn>(&::hypot))},
+        {"fabs", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::fabs))},
+        {"floor", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::floor))},
+        {"ceil", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::ceil))},
+        {"round", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::round))},
+        {"trunc", 1, pointerToJITTargetAddress(static_cast<UnaryMathFn>(&::trunc))},
+        {"fmod", 2, pointerToJITTargetAddress(static_cast<BinaryMathFn>(&::fmod))},
+        {"fmin", 2, pointerToJITTargetAddress(static_cast<BinaryMathFn>(&::fmin))},
+        {"fmax", 2, pointerToJITTargetAddress(static_cast<BinaryMathFn>(&::fmax))},
+    };
+    return Functions;
+}
+
+static const HostFunction* findHostFunction(StringRef Name){
+    for(const HostFunction& Fn : getHostFunctions())
+        if(Name == Fn.Name)
+            return &Fn;
+    return nullptr;
+}
+
+/// addExtern - Record the prototype of an extern. An extern of a function that is
+/// already known only checks that it agrees, so what was found out about the
+/// function is kept. Externs of the host functions are readnone and nounwind, as
+/// Kaleidoscope code never looks at errno, and always return, so unused calls go.
+/// Returns false after reporting a prototype that disagrees.
+static bool addExtern(PrototypeMap& Protos, std::unique_ptr<PrototypeAST> Proto){
+    size_t NumArgs = Proto->getArgs().size();
+    if(const HostFunction* Host = findHostFunction(Proto->getName())){
+        if(Host->NumArgs != NumArgs){
+            LogError("extern doesn't match the number of arguments of the library function");
+            return false;
+        }
+        if(!Proto->isAllF64()){
+            LogError("extern of a library function has to take and return f64");
+            return false;
+        }
+        Proto->setAttributes(/*ReadNone*/ true, /*NoUnwind*/ true, /*WillReturn*/ true);
+    }
+
+    auto FI = Protos.find(Proto->getSymbol());
+    if(FI != Protos.end()){
+        if(FI->second->getArgs().size() != NumArgs){
+            LogError("extern doesn't match the number of arguments of an earlier prototype");
+            return false;
+        }
+        if(!FI->second->hasSameTypes(*Proto)){
+            LogError("extern doesn't match the argument or result types of an earlier prototype");
+            return false;
+        }
+        return true;
+    }
+
+    Protos[Proto->getSymbol()] = std::move(Proto);
+    return true;
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of host functions
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Top-Level parsing
+//------------------------------------------------------------------------------------------------------//
+
+/// TopLevelItem - A parsed top-level item on its way from the -pipeline parser
+/// thread to the thread compiling it, together with the arena its expression
+/// nodes live in.
+struct TopLevelItem{
+    enum ItemKind {Definition, Extern, Expression, EndOfInput} Kind = EndOfInput;
+    BumpPtrAllocator AST;
+    std::unique_ptr<FunctionAST> Function;  // Definition or Expression.
+    std::unique_ptr<PrototypeAST> Proto;    // Extern.
+};
+
+/// TieredFunction - A definition -tiered compiled at tier 0: the bitcode of its
+/// module before the counters went in, and the counters. The first counts calls,
+/// then there are two for each conditional branch, counting how often it went
+/// either way.
+struct TieredFunction{
+    std::string Name;
+    SmallVector<char, 0> Bitcode;
+    std::unique_ptr<uint64_t[]> Counters;
+    unsigned NumCounters;
+};
+
+/// CompilationSession - All the state of one run of the compiler: the symbol table,
+/// lexer and parser, the prototypes of everything seen so far, the module currently
+/// being filled, and where finished code goes (the JIT, or the output file with -c).
+class CompilationSession{
+    private:
+        /// Embedded - Run for a KaleidoscopeEngine rather than the driver: nothing is
+        /// printed, definitions are compiled up front so calls on other threads never
+        /// compile, and every definition gets a NAME.map entry point.
+        const bool Embedded;
+
+        /// TopLevelResults - Where an embedded compile collects the values of the
+        /// top-level expressions, if anywhere.
+        std::vector<double>* TopLevelResults = nullptr;
+
+        SymbolTable Symbols;
+        Lexer TheLexer;
+        Parser TheParser;
+        PrototypeMap FunctionProtos;
+
+        std::unique_ptr<KaleidoscopeJIT> TheJIT;
+        std::unique_ptr<TargetMachine> TheTargetMachine; // For CG, and for the output file with -c.
+        std::unique_ptr<ObjectFileCache> TheCache;       // Only used with -cache-dir.
+        std::unique_ptr<BatchRuntime> TheBatchRuntime;   // Started by the first runMap.
+        std::unique_ptr<PhaseTimers> TheTimers;          // Only with -time-phases,
+        std::unique_ptr<TimePassesHandler> ThePassTimer; // shared by every module.
+        DataLayout TheDataLayout;
+        Triple TheTriple;
+
+        /// SourceHashes - With -c -filetype=lib, the source hash of every definition,
+        /// for the library's index. LibraryHashes - The source hash of every library
+        /// function no definition has replaced yet.
+        DenseMap<SymbolID, std::array<uint8_t, 16> > SourceHashes;
+        DenseMap<SymbolID, std::array<uint8_t, 16> > LibraryHashes;
+
+        /// Results - With -memoize, the value of every top-level expression run since
+        /// the last definition that only computes, by the expression's source hash.
+        StringMap<double> Results;
+
+        /// MemoGeneration - Bumped by every definition, which turns every entry left
+        /// in the caches of -memoize into a miss. Code reads it as MemoGenerationName,
+        /// atomically, as it may run on other threads while this one defines.
+        std::atomic<uint64_t> MemoGeneration{0};
+        static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free,
+                      "JIT'd code loads MemoGeneration as a plain i64");
+
+        std::unique_ptr<CodeGen> CG;
+
+        /// -tiered state. TierZero owns every tier 0 function, which the counters in
+        /// its code point into, and CurrentTierZero has the newest one of each name.
+        /// TieredUp holds the recompiled functions the background thread finished,
+        /// or why it couldn't, for the main thread to install or report.
+        std::vector<std::unique_ptr<TieredFunction> > TierZero;
+        StringMap<TieredFunction*> CurrentTierZero;
+        std::mutex TieredUpLock;
+        std::vector<std::pair<TieredFunction*, Expected<std::unique_ptr<MemoryBuffer> > > > TieredUp;
+        std::unique_ptr<ThreadPool> TierUpPool; // Last, so it finishes before the rest goes.
+
+        void InitializeModule(){
+            CG = std::make_unique<CodeGen>(Symbols, FunctionProtos, TheDataLayout, TheTriple, TheTargetMachine.get(),
+                                           TheTimers.get(), ThePassTimer.get());
+            CG->MapWrappers = EmitMapWrappers || Embedded;
+            if(Embedded)
+                CG->TheContext->setDiagnosticHandlerCallBack(logDiagnostic);
+        }
+
+        void addPrototype(const PrototypeAST& Proto){
+            FunctionProtos[Proto.getSymbol()] = std::make_unique<PrototypeAST>(Proto);
+        }
+
+        void HandleDefinition();
+        void HandleExtern();
+        void HandleTopLevelExpression();
+        Error defineFunction(std::unique_ptr<FunctionAST> FnAST);
+        void declareExtern(std::unique_ptr<PrototypeAST> ProtoAST);
+        Error evaluateTopLevelExpression(FunctionAST& FnAST);
+        void reportResult(double Result);
+        bool checkJITError(Error Err);
+        void MainLoop();
+
+        void parseItems(SPSCQueue<TopLevelItem>& Queue);
+        bool runPipelined(ArrayRef<std::string> Inputs);
+
+        SmallString<32> getCacheKey(const FunctionAST& FnAST) const;
+        std::array<uint8_t, 16> getSourceHash(const FunctionAST& FnAST) const;
+        bool loadLibrary(StringRef Path);
+        std::vector<LibraryEntry> getLibraryEntries();
+        std::unique_ptr<TargetMachine> createCodeGenTarget();
+        std::unique_ptr<MemoryBuffer> compileToObject(Module& M, TargetMachine& TM, PhaseTimers* Timers);
+
+        bool compileInParallel(ArrayRef<std::string> Inputs);
+        bool emitOutputFile();
+
+        void instrumentForTierUp(Function& F);
+        static void tierUp(CompilationSession* Session, TieredFunction* TF);
+        Expected<std::unique_ptr<MemoryBuffer> > compileTierUp(const TieredFunction& TF, JITTargetMachineBuilder JTMB);
+        Error installTierUps();
+
+    public:
+        explicit CompilationSession(bool Embedded = false)
+            : Embedded(Embedded), TheLexer(Symbols), TheParser(TheLexer, Symbols), TheDataLayout("") {}
+
+        bool initialize();
+        bool run(ArrayRef<std::string> Inputs);
+        void compileSource(StringRef Source, std::vector<double>* Results);
+        void* lookupFunction(StringRef Name, ArrayRef<ValueType> ArgTypes, ValueType ReturnType);
+        bool runMap(StringRef Name, ArrayRef<const double*> Columns, double* Out, uint64_t N);
+        MemoryStats getMemoryStats() const;
+        void printTimingReport();
+        void printMemoryStats() const;
+};
+
+void CompilationSession::HandleDefinition(){
+    std::unique_ptr<FunctionAST> FnAST;
+    {
+        PhaseScope Phase(TheTimers.get(), phase_parse);
+        FnAST = TheParser.ParseDefinition();
+    }
+
+    if(FnAST){
+        checkJITError(defineFunction(std::move(FnAST)));
+    }else{
+        // Skip token for error recovery.
+        TheParser.getNextToken();
+    }
+}
+
+void CompilationSession::HandleExtern(){
+    std::unique_ptr<PrototypeAST> ProtoAST;
+    {
+        PhaseScope Phase(TheTimers.get(), phase_parse);
+        ProtoAST = TheParser.ParseExtern();
+    }
+
+    if(ProtoAST){
+        declareExtern(std::move(ProtoAST));
+    }else{
+        // Skip token for error recovery
+        TheParser.getNextToken();
+    }
+}
+
+/// defineFunction - Generate a parsed definition and hand it to the JIT, or add it
+/// to the output module with -c. Fails only if the JIT does.
+Error CompilationSession::defineFunction(std::unique_ptr<FunctionAST> FnAST){
+    SymbolID Sym = FnAST->getProto().getSymbol();
+    if(CompileOnly && FileType == OFT_Library)
+        SourceHashes[Sym] = getSourceHash(*FnAST);
+
+    // Feeding the JIT the source a library was compiled from, as well as the library,
+    // keeps the library's code. Any other definition replaces it.
+    auto LI = LibraryHashes.find(Sym);
+    if(LI != LibraryHashes.end() && !CompileOnly){
+        if(LI->second == getSourceHash(*FnAST)){
+            ++NumLibraryDefinitionsKept;
+            if(!Embedded)
+                std::cout << "Using " << FnAST->getProto().getName().str() << " from a library" << std::endl;
+            return Error::success();
+        }
+        LibraryHashes.erase(LI);
+    }
+
+    // Whatever was computed with the definitions so far may have changed.
+    Results.clear();
+    MemoGeneration.fetch_add(1, std::memory_order_release);
+
+    // A definition compiled by an earlier run is loaded without generating any code.
+    SmallString<32> CacheKey;
+    if(TheCache){
+        CacheKey = getCacheKey(*FnAST);
+        if(auto Obj = TheCache->getObject(CacheKey)){
+            ++NumCacheHits;
+            if(!Embedded)
+                std::cout << "Loaded " << FnAST->getProto().getName().str() << " from the object cache" << std::endl;
+            addPrototype(FnAST->getProto());
+            return TheJIT->addRedefinableObjectFile(std::move(Obj));
+        }
+    }
+
+    // -tiered starts definitions off barely optimized, see instrumentForTierUp.
+    bool TierZero = Tiered && !CompileOnly;
+    if(auto* FnIR = FnAST->codegen(*CG, /*Optimize*/ !TierZero)){
+        addPrototype(FnAST->getProto());
+
+        // When compiling to a file every definition stays in the one module.
+        if(CompileOnly)
+            return Error::success();
+
+        if(!Embedded){
+            std::cout << "Parsed a function definition:" << std::endl;
+            FnIR->print(errs());
+            std::cout << std::endl;
+        }
+
+        // Hand the finished module to the JIT and start a new one for the
+        // following definitions. Each definition stays in a module of its own,
+        // so defining the function again only replaces its code. A definition
+        // going into the cache has to be compiled now, even by a lazy JIT.
+        if(TheCache){
+            auto Obj = compileToObject(*CG->TheModule, *TheTargetMachine, TheTimers.get());
+            ++NumCacheMisses;
+            TheCache->storeObject(CacheKey, *Obj);
+            CG->startModule();
+            return TheJIT->addRedefinableObjectFile(std::move(Obj));
+        }
+        if(TierZero)
+            instrumentForTierUp(*FnIR);
+        return TheJIT->addRedefinableModule(CG->takeModule(), /*Quick*/ TierZero);
+    }
+    return Error::success();
+}
+
+/// declareExtern - Record a parsed extern and declare it in the current module.
+void CompilationSession::declareExtern(std::unique_ptr<PrototypeAST> ProtoAST){
+    SymbolID Sym = ProtoAST->getSymbol();
+    if(!addExtern(FunctionProtos, std::move(ProtoAST)))
+        return;
+
+    if(auto* FnIR = CG->getFunction(Sym)){
+        if(!CompileOnly && !Embedded){
+            std::cout << "Parsed an extern:" << std::endl;
+            FnIR->print(errs());
+            std::cout << std::endl;
+        }
+    }
+}
+
+void CompilationSession::HandleTopLevelExpression(){
+    // Evaluate a top-level expression into an anonymous function.
+    std::unique_ptr<FunctionAST> FnAST;
+    {
+        PhaseScope Phase(TheTimers.get(), phase_parse);
+        FnAST = TheParser.ParseTopLevelExpr();
+    }
+
+    if(FnAST){
+        checkJITError(evaluateTopLevelExpression(*FnAST));
+    }else{
+        // Skip token for error recovery.
+        TheParser.getNextToken();
+    }
+}
+
+/// evaluateTopLevelExpression - Run a parsed top-level expression and report its
+/// value. Fails only if the JIT does.
+Error CompilationSession::evaluateTopLevelExpression(FunctionAST& FnAST){
+    // With -memoize an expression seen before is only looked up.
+    std::array<uint8_t, 16> SourceHash;
+    StringRef ResultKey;
+    if(Memoize && !CompileOnly){
+        SourceHash = getSourceHash(FnAST);
+        ResultKey = StringRef(reinterpret_cast<const char*>(SourceHash.data()), SourceHash.size());
+        auto RI = Results.find(ResultKey);
+        if(RI != Results.end()){
+            ++NumResultsReused;
+            reportResult(RI->second);
+            return Error::success();
+        }
+    }
+
+    if(auto* FnIR = FnAST.codegen(*CG)){
+        // There is nothing to run an expression when compiling to a file, so
+        // it is only checked, and its function is kept for the next one.
+        if(CompileOnly){
+            CG->recycleFunction(FnIR);
+            return Error::success();
+        }
+
+        if(!Embedded){
+            std::cout << "Parsed a top-level expression:" << std::endl;
+            FnIR->print(errs());
+            std::cout << std::endl;
+        }
+
+        // Create a ResourceTracker to track JIT'd memory allocated to our
+        // anonymous expression -- that way we can free it after executing.
+        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+        if(auto Err = TheJIT->addEagerModule(CG->takeModule(), RT))
+            return joinErrors(std::move(Err), RT->remove());
+
+        // Whatever -tiered has recompiled so far is used from now on. A function that
+        // failed to move up is reported, but keeps working at tier 0.
+        if(TierUpPool)
+            checkJITError(installTierUps());
+
+        // Search the JIT for the __anon_expr symbol, which compiles it.
+        PhaseScope Phase(TheTimers.get(), phase_codegen, "__anon_expr");
+        auto ExprSymbol = TheJIT->lookup("__anon_expr");
+        if(!ExprSymbol)
+            return joinErrors(ExprSymbol.takeError(), RT->remove());
+
+        // Get the symbol's address and cast it to the right type (takes no
+        // arguments, returns a double) so we can call it as a native function.
+        double (*FP)() = (double (*)())(intptr_t)ExprSymbol->getAddress();
+        Phase.switchTo(phase_execute);
+        double Result = FP();
+        Phase.finish();
+        ++NumEvaluated;
+        reportResult(Result);
+
+        // Without new definitions the results would pile up, so they are kept to
+        // as many as a function's cache holds.
+        if(!ResultKey.empty() && FnAST.getProto().isReadNone() && FnAST.getProto().isNoUnwind()){
+            if(Results.size() >= MemoizeEntries)
+                Results.clear();
+            Results[ResultKey] = Result;
+        }
+
+        // Delete the anonymous expression module from the JIT.
+        return RT->remove();
+    }
+    return Error::success();
+}
+
+/// reportResult - Print the value of a top-level expression, or for an embedded
+/// compile hand it to the caller.
+void CompilationSession::reportResult(double Result){
+    if(!Embedded)
+        std::cout << "Evaluated to " << Result << std::endl;
+    else if(TopLevelResults)
+        TopLevelResults->push_back(Result);
+}
+
+/// checkJITError - Whether Err is a success. The driver gives up on any JIT error,
+/// while an embedded session reports it with LogError, so only the engine call
+/// fails and the host carries on.
+bool CompilationSession::checkJITError(Error Err){
+    if(!Err)
+        return true;
+    if(!Embedded)
+        ExitOnErr(std::move(Err));
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+}
+
+/// getCacheKey - Name of the object cache entry for a definition. Besides the
+/// definition itself it covers everything else that changes the object code:
+/// the optimization level, the JIT's target and the LLVM version.
+SmallString<32> CompilationSession::getCacheKey(const FunctionAST& FnAST) const{
+    const JITTargetMachineBuilder& JTMB = TheJIT->getTargetMachineBuilder();
+    MD5 Hash;
+    hashString(Hash, LLVM_VERSION_STRING);
+    hashString(Hash, JTMB.getTargetTriple().str());
+    hashString(Hash, JTMB.getCPU());
+    hashString(Hash, JTMB.getFeatures().getString());
+    hashInt(Hash, OptLevel);
+    hashInt(Hash, CG->MapWrappers);
+    hashInt(Hash, getFastMathBits(FnAST.getProto().getName()));
+    hashInt(Hash, Memoize ? (uint64_t)MemoizeEntries : 0);
+    FnAST.addToHash(Hash, HashContext{Symbols, FunctionProtos});
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return Result.digest();
+}
+
+/// getSourceHash - Hash of a definition's source, for the index of a library. Like
+/// the cache key it covers the attributes of the callees, but nothing about the
+/// target, since a library holds bitcode.
+std::array<uint8_t, 16> CompilationSession::getSourceHash(const FunctionAST& FnAST) const{
+    MD5 Hash;
+    FnAST.addToHash(Hash, HashContext{Symbols, FunctionProtos});
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return Result;
+}
+
+/// loadLibrary - Declare every function of the library at Path, and with a JIT
+/// make them callable. A function an earlier library already declares comes
+/// from that one.
+bool CompilationSession::loadLibrary(StringRef Path){
+    auto LibOrErr = KaleidoscopeLibrary::Open(Path);
+    if(!LibOrErr){
+        std::cerr << "Error: " << toString(LibOrErr.takeError()) << std::endl;
+        return false;
+    }
+    std::unique_ptr<KaleidoscopeLibrary> Lib = std::move(*LibOrErr);
+
+    for(const LibrarySymbol& LibSym : Lib->symbols()){
+        SymbolID Sym = Symbols.intern(Lib->getName(LibSym));
+        std::vector<ValueType> ArgTypes;
+        for(uint8_t Ty : Lib->getArgTypes(LibSym))
+            ArgTypes.push_back((ValueType)Ty);
+        if(LibSym.ReturnType >= vt_infer || llvm::any_of(ArgTypes, [](ValueType Ty){ return Ty >= vt_infer; })){
+            std::cerr << "Error: " << Path.str() << ": " << Symbols.getName(Sym).str()
+                      << " has an unknown argument or result type" << std::endl;
+            return false;
+        }
+
+        // The argument names aren't kept, a declaration doesn't need them.
+        auto Proto = std::make_unique<PrototypeAST>(Sym, Symbols.getName(Sym), std::vector<SymbolID>(LibSym.NumArgs),
+                                                    LibSym.Operator, LibSym.Precedence, /*Definition*/ true,
+                                                    std::move(ArgTypes), (ValueType)LibSym.ReturnType);
+        auto FI = FunctionProtos.find(Sym);
+        if(FI != FunctionProtos.end()){
+            if(!checkRedefinition(*FI->second, *Proto))
+                continue;
+            std::cerr << "Error: " << Path.str() << ": " << Symbols.getName(Sym).str()
+                      << " takes different arguments than in an earlier library" << std::endl;
+            return false;
+        }
+
+        Proto->setAttributes(LibSym.Flags & libsym_readnone, LibSym.Flags & libsym_nounwind);
+        if(Proto->isBinaryOp())
+            TheParser.registerBinaryOperator(Proto->getOperatorName(), Proto->getBinaryPrecedence(), Sym);
+        else if(Proto->isUnaryOp())
+            TheParser.registerUnaryOperator(Proto->getOperatorName(), Sym);
+
+        FunctionProtos[Sym] = std::move(Proto);
+        std::copy(std::begin(LibSym.SourceHash), std::end(LibSym.SourceHash), LibraryHashes[Sym].begin());
+        ++NumLibraryFunctions;
+    }
+
+    if(TheJIT)
+        TheJIT->addLibrary(std::move(Lib));
+    return true;
+}
+
+/// compileToObject - Compile a module to an object file for the JIT, with a
+/// TargetMachine made by createCodeGenTarget. The time is charged to Timers if given.
+std::unique_ptr<MemoryBuffer> CompilationSession::compileToObject(Module& M, TargetMachine& TM, PhaseTimers* Timers){
+    PhaseScope Phase(Timers, phase_codegen);
+    SimpleCompiler Compile(TM);
+    return ExitOnErr(Compile(M));
+}
+
+/// runMap - Set Out[i] = Name(Columns[0][i], ...) for every i < N, on every core.
+/// Name must be a definition compiled by this session with -map-wrappers.
+bool CompilationSession::runMap(StringRef Name, ArrayRef<const double*> Columns, double* Out, uint64_t N){
+    auto FI = FunctionProtos.find(Symbols.find(Name));
+    if(FI == FunctionProtos.end() || FI->second->getArgs().size() != Columns.size()){
+        LogError(("no definition of " + Name + " taking " + Twine(Columns.size()) + " arguments").str().c_str());
+        return false;
+    }
+
+    auto MapSymbol = TheJIT->lookup((Name + ".map").str());
+    if(!MapSymbol){
+        LogError(toString(MapSymbol.takeError()).c_str());
+        return false;
+    }
+
+    if(!TheBatchRuntime)
+        TheBatchRuntime = std::make_unique<BatchRuntime>();
+
+    auto Map = (BatchRuntime::MapFunction)(intptr_t)MapSymbol->getAddress();
+    TheBatchRuntime->run(Map, Columns, Out, N);
+    return true;
+}
+
+/// compileSource - Handle every item of Source in order, as MainLoop does those
+/// of a file, with the values of the top-level expressions going to Results.
+void CompilationSession::compileSource(StringRef Source, std::vector<double>* Results){
+    TopLevelResults = Results;
+    TheLexer.openBuffer(MemoryBuffer::getMemBuffer(Source, "<source>", /*RequiresNullTerminator*/ false));
+    TheParser.getNextToken();
+    MainLoop();
+    TopLevelResults = nullptr;
+}
+
+/// lookupFunction - The address of Name, a function taking ArgTypes and returning
+/// ReturnType, or null after reporting why not. It only looks at the session, so
+/// lookups can run on several threads at once, as long as nothing is compiling.
+void* CompilationSession::lookupFunction(StringRef Name, ArrayRef<ValueType> ArgTypes, ValueType ReturnType){
+    auto FI = FunctionProtos.find(Symbols.find(Name));
+    if(FI == FunctionProtos.end()){
+        LogError(("no function named " + Name).str().c_str());
+        return nullptr;
+    }
+    const PrototypeAST& Proto = *FI->second;
+    if(ArrayRef<ValueType>(Proto.getArgTypes()) != ArgTypes || Proto.getReturnType() != ReturnType){
+        LogError((Name + " takes or returns other types than asked for").str().c_str());
+        return nullptr;
+    }
+
+    auto Symbol = TheJIT->lookup(Name);
+    if(!Symbol){
+        LogError(toString(Symbol.takeError()).c_str());
+        return nullptr;
+    }
+    return jitTargetAddressToPointer<void*>(Symbol->getAddress());
+}
+
+/// getMemoryStats - What the session holds now. Only reads counters, so it can run
+/// alongside lookups and calls.
+MemoryStats CompilationSession::getMemoryStats() const{
+    MemoryStats Stats = {};
+    Stats.ASTBytes = TheParser.getASTBytes();
+    Stats.PeakASTBytes = TheParser.getPeakASTBytes();
+    if(TheJIT){
+        Stats.JITCodeBytes = TheJIT->getMemoryUsage().CodeBytes;
+        Stats.JITDataBytes = TheJIT->getMemoryUsage().DataBytes;
+    }
+    Stats.HeapBytes = sys::Process::GetMallocUsage();
+    return Stats;
+}
+
+/// top ::= definition | external | expression | ';'
+void CompilationSession::MainLoop(){
+    while(true){
+        switch(TheParser.CurTok){
+            case tok_eof:
+                return;
+            case ';': // ignore top-level semicolons.
+                if(!CompileOnly && !Embedded)
+                    std::cout << "ready> ";
+                TheParser.getNextToken();
+                break;
+            case tok_def:
+                HandleDefinition();
+                break;
+            case tok_extern:
+                HandleExtern();
+                break;
+            default:
+                HandleTopLevelExpression();
+                break;
+        }
+
+        // The item is finished with, release all of its AST nodes at once.
+        TheParser.releaseAST();
+    }
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of top-level parsing
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Batch compilation
+//------------------------------------------------------------------------------------------------------//
+
+static CodeGenOpt::Level getCodeGenOptLevel(){
+    switch(OptLevel){
+        case '0':
+            return CodeGenOpt::None;
+        case '1':
+            return CodeGenOpt::Less;
+        case '3':
+            return CodeGenOpt::Aggressive;
+        default:
+            return CodeGenOpt::Default;
+    }
+}
+
+/// createTargetMachine - Target description for object files written with -c. The
+/// output is for the host triple and, unless -mcpu says otherwise, a generic CPU,
+/// so it runs wherever the host does.
+static std::unique_ptr<TargetMachine> createTargetMachine(){
+    std::string TargetTriple = sys::getDefaultTargetTriple();
+    std::string Error;
+    const Target* TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
+    if(!TheTarget){
+        std::cerr << "Error: " << Error << std::endl;
+        return nullptr;
+    }
+
+    std::string CPU = TargetCPU;
+    SubtargetFeatures Features;
+    if(CPU == "native"){
+        CPU = sys::getHostCPUName().str();
+        StringMap<bool> HostFeatures;
+        if(sys::getHostCPUFeatures(HostFeatures))
+            for(auto& Feature : HostFeatures)
+                Features.AddFeature(Feature.first(), Feature.second);
+    }
+
+    TargetOptions Opts;
+    return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(TargetTriple, CPU, Features.getString(), Opts,
+                                                                         Optional<Reloc::Model>(Reloc::PIC_),
+                                                                         None, getCodeGenOptLevel()));
+}
+
+/// getOutputFilename - The -o name, or the first input's stem with the extension
+/// for -filetype.
+static std::string getOutputFilename(){
+    if(!OutputFilename.empty())
+        return OutputFilename;
+
+    StringRef Input = InputFilenames.empty() ? "-" : StringRef(InputFilenames[0]);
+    SmallString<128> Name(Input == "-" ? StringRef("output") : sys::path::stem(Input));
+    Name.append(FileType == OFT_Bitcode ? ".bc" : FileType == OFT_Library ? ".klib" : ".o");
+    return std::string(Name);
+}
+
+/// optimizeModule - Once every definition is in one module, run LLVM's module
+/// pipeline for Level over all of them together: small definitions are inlined
+/// into their callers, constants propagate across calls and whatever is left
+/// unused is removed. PIC, if given, instruments the passes.
+static void optimizeModule(Module& M, TargetMachine* TM, PassInstrumentationCallbacks* PIC, OptimizationLevel Level){
+    if(Level == OptimizationLevel::O0)
+        return;
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(TM, PipelineTuningOptions(), None, PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+}
+
+/// emitOutputFile - Write everything compiled with -c as an object or bitcode file.
+bool CompilationSession::emitOutputFile(){
+    PhaseScope Phase(TheTimers.get(), phase_optimize, "module");
+    // A library's functions are called through the JIT's stubs once loaded, so
+    // redefining one changes what the others call. Inlining or propagating one
+    // into another would keep the old body, so libraries are only optimized a
+    // definition at a time, as the REPL does.
+    if(InterproceduralOpt && FileType != OFT_Library)
+        optimizeModule(*CG->TheModule, TheTargetMachine.get(), CG->ThePIC.get(), getOptimizationLevel());
+    Phase.switchTo(phase_codegen);
+
+    std::string Filename = getOutputFilename();
+    std::error_code EC;
+    raw_fd_ostream Dest(Filename, EC, sys::fs::OF_None);
+    if(EC){
+        std::cerr << "Error: could not open " << Filename << ": " << EC.message() << std::endl;
+        return false;
+    }
+
+    if(FileType == OFT_Bitcode){
+        WriteBitcodeToFile(*CG->TheModule, Dest);
+    }else if(FileType == OFT_Library){
+        SmallVector<char, 0> Bitcode;
+        raw_svector_ostream OS(Bitcode);
+        WriteBitcodeToFile(*CG->TheModule, OS);
+        writeLibrary(Dest, getLibraryEntries(), StringRef(Bitcode.data(), Bitcode.size()));
+    }else{
+        legacy::PassManager Pass;
+        if(TheTargetMachine->addPassesToEmitFile(Pass, Dest, nullptr, CGFT_ObjectFile)){
+            std::cerr << "Error: the target can't emit object files" << std::endl;
+            return false;
+        }
+        Pass.run(*CG->TheModule);
+    }
+
+    Dest.flush();
+    return true;
+}
+
+/// getLibraryEntries - The index of a library of the output module: every function
+/// defined in it, with the attributes it was optimized to.
+std::vector<LibraryEntry> CompilationSession::getLibraryEntries(){
+    std::vector<LibraryEntry> Entries;
+    for(Function& F : *CG->TheModule){
+        if(F.isDeclaration() || F.hasLocalLinkage())
+            continue;
+
+        // Map wrappers have no prototype, they aren't called from Kaleidoscope.
+        SymbolID Sym = Symbols.intern(F.getName());
+        auto FI = FunctionProtos.find(Sym);
+        if(FI == FunctionProtos.end())
+            continue;
+
+        const PrototypeAST& Proto = *FI->second;
+        uint8_t Flags = (F.doesNotAccessMemory() ? libsym_readnone : 0) | (F.doesNotThrow() ? libsym_nounwind : 0);
+        Entries.push_back({F.getName().str(), (uint32_t)F.arg_size(), (uint8_t)Proto.getOperatorName(),
+                           (uint8_t)Proto.getBinaryPrecedence(), Flags, SourceHashes.lookup(Sym),
+                           std::vector<uint8_t>(Proto.getArgTypes().begin(), Proto.getArgTypes().end()),
+                           Proto.getReturnType()});
+    }
+    return Entries;
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of batch compilation
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Parallel compilation
+//------------------------------------------------------------------------------------------------------//
+
+/// parseInput - Parse the rest of the parser's input, sorting the items into
+/// definitions and top-level expressions. The prototype of every definition
+/// and extern goes into Protos as soon as it is parsed. The AST arena is not
+/// released, so the items stay valid until the caller releases it. Returns
+/// false if a function is defined twice, which -j can't do, as every expression
+/// would see the last definition.
+static bool parseInput(Parser& P, PrototypeMap& Protos, std::vector<std::unique_ptr<FunctionAST> >& Definitions,
+                       std::vector<std::unique_ptr<FunctionAST> >& TopLevelExprs){
+    bool Succeeded = true;
+    DenseSet<SymbolID> Defined;
+    for(auto& FnAST : Definitions)
+        Defined.insert(FnAST->getProto().getSymbol());
+
+    P.getNextToken();
+    while(P.CurTok != tok_eof){
+        switch(P.CurTok){
+            case ';': // ignore top-level semicolons.
+                P.getNextToken();
+                continue;
+            case tok_def:
+                if(auto FnAST = P.ParseDefinition()){
+                    // Every call is generated against the last prototype, so one
+                    // definition can't take different arguments than another.
+                    const PrototypeAST& Proto = FnAST->getProto();
+                    auto FI = Protos.find(Proto.getSymbol());
+                    if(FI != Protos.end())
+                        if(const char* Err = checkRedefinition(*FI->second, Proto)){
+                            LogError(Err);
+                            continue;
+                        }
+                    if(!Defined.insert(Proto.getSymbol()).second){
+                        LogError(("-j can't define " + Proto.getName() + " again").str().c_str());
+                        Succeeded = false;
+                        continue;
+                    }
+                    Protos[Proto.getSymbol()] = std::make_unique<PrototypeAST>(Proto);
+                    Definitions.push_back(std::move(FnAST));
+                    continue;
+                }
+                break;
+            case tok_extern:
+                if(auto ProtoAST = P.ParseExtern()){
+                    addExtern(Protos, std::move(ProtoAST));
+                    continue;
+                }
+                break;
+            default:
+                if(auto FnAST = P.ParseTopLevelExpr()){
+                    TopLevelExprs.push_back(std::move(FnAST));
+                    continue;
+                }
+                break;
+        }
+
+        // Skip token for error recovery.
+        P.getNextToken();
+    }
+    return Succeeded;
+}
+
+/// compileInParallel - The -j mode. Every input is parsed up front, then the
+/// definitions are split into chunks that are generated, optimized and (for an
+/// eager JIT) compiled to machine code on a thread pool, each worker into a module
+/// and context of its own. Every prototype is known before any body is generated,
+/// so workers only ever read FunctionProtos. The results are added to the JIT, or
+/// linked into the output module for -c, before the top-level expressions are run
+/// in order. Definitions are all compiled up front, so the expressions only see
+/// the same functions if each is defined once; a redefinition fails the run.
+bool CompilationSession::compileInParallel(ArrayRef<std::string> Inputs){
+    std::vector<std::unique_ptr<FunctionAST> > Definitions;
+    std::vector<std::unique_ptr<FunctionAST> > TopLevelExprs;
+
+    // Parse everything, keeping the AST arena alive until codegen is done with it.
+    for(const auto& Filename : Inputs){
+        if(!TheLexer.openSource(Filename))
+            return false;
+
+        PhaseScope Phase(TheTimers.get(), phase_parse, Filename);
+        if(!parseInput(TheParser, FunctionProtos, Definitions, TopLevelExprs))
+            return false;
+    }
+
+    if(CompileOnly && FileType == OFT_Library)
+        for(auto& FnAST : Definitions)
+            SourceHashes[FnAST->getProto().getSymbol()] = getSourceHash(*FnAST);
+
+    // A chunk is a range of Definitions. Definitions found in the object cache are
+    // loaded straight away and the rest is split into a few chunks per thread, so
+    // uneven definitions still balance out. Each cache entry holds one definition,
+    // so with a cache every definition that is compiled gets a chunk of its own.
+    // The main thread only waits for the workers, so all of their work is timed
+    // as code generation.
+    PhaseScope Phase(TheTimers.get(), phase_codegen, "parallel");
+    ThreadPool Pool(hardware_concurrency(NumThreads));
+    std::vector<std::pair<size_t, size_t> > Chunks;
+    std::vector<SmallString<32> > CacheKeys;
+    if(TheCache){
+        for(size_t I = 0, E = Definitions.size(); I != E; ++I){
+            SmallString<32> Key = getCacheKey(*Definitions[I]);
+            if(auto Obj = TheCache->getObject(Key)){
+                ++NumCacheHits;
+                ExitOnErr(TheJIT->addObjectFile(std::move(Obj)));
+                continue;
+            }
+            Chunks.push_back({I, I + 1});
+            CacheKeys.push_back(Key);
+        }
+    }else{
+        size_t NumChunks = std::min<size_t>(Definitions.size(), Pool.getThreadCount() * 4);
+        size_t ChunkSize = NumChunks ? (Definitions.size() + NumChunks - 1) / NumChunks : 0;
+        for(size_t Begin = 0; Begin < Definitions.size(); Begin += ChunkSize)
+            Chunks.push_back({Begin, std::min(Definitions.size(), Begin + ChunkSize)});
+    }
+
+    // Each chunk produces an optimized module for a lazy JIT, an object file for
+    // an eager one or the cache, or a bitcode image for -c.
+    size_t NumChunks = Chunks.size();
+    std::vector<ThreadSafeModule> Modules(NumChunks);
+    std::vector<std::unique_ptr<MemoryBuffer> > Objects(NumChunks);
+    std::vector<SmallVector<char, 0> > Bitcode(NumChunks);
+
+    for(size_t Chunk = 0; Chunk != NumChunks; ++Chunk){
+        Pool.async([this, Chunk, &Chunks, &CacheKeys, &Definitions, &Modules, &Objects, &Bitcode](){
+            // Timers can't be shared between threads, so only -time-trace sees the workers.
+            ThreadTraceScope Trace;
+            auto TM = createCodeGenTarget();
+            CodeGen WorkerCG(Symbols, FunctionProtos, TheDataLayout, TheTriple, TM.get());
+            for(size_t I = Chunks[Chunk].first; I != Chunks[Chunk].second; ++I)
+                Definitions[I]->codegen(WorkerCG);
+
+            if(CompileOnly){
+                raw_svector_ostream OS(Bitcode[Chunk]);
+                WriteBitcodeToFile(*WorkerCG.TheModule, OS);
+                return;
+            }
+
+            if(LazyCompile && !TheCache){
+                Modules[Chunk] = WorkerCG.takeModule();
+                return;
+            }
+
+            Objects[Chunk] = compileToObject(*WorkerCG.TheModule, *TM, nullptr);
+            if(TheCache){
+                ++NumCacheMisses;
+                TheCache->storeObject(CacheKeys[Chunk], *Objects[Chunk]);
+            }
+        });
+    }
+    Pool.wait();
+    Phase.finish();
+
+    CG->startModule();
+    for(size_t Chunk = 0; Chunk != NumChunks; ++Chunk){
+        if(!CompileOnly){
+            if(Objects[Chunk])
+                ExitOnErr(TheJIT->addObjectFile(std::move(Objects[Chunk])));
+            else
+                ExitOnErr(TheJIT->addModule(std::move(Modules[Chunk])));
+            continue;
+        }
+
+        MemoryBufferRef Buf(StringRef(Bitcode[Chunk].data(), Bitcode[Chunk].size()), "chunk");
+        auto ChunkModule = ExitOnErr(parseBitcodeFile(Buf, *CG->TheContext));
+        if(Linker::linkModules(*CG->TheModule, std::move(ChunkModule)))
+            return false;
+    }
+
+    for(auto& FnAST : TopLevelExprs)
+        checkJITError(evaluateTopLevelExpression(*FnAST));
+
+    TheParser.releaseAST();
+    return !CompileOnly || emitOutputFile();
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of parallel compilation
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Pipelined compilation
+//------------------------------------------------------------------------------------------------------//
+
+/// PipelineDepth - How many parsed items the -pipeline parser may get ahead of the
+/// code generator. Each one holds on to its AST, so this bounds the memory used.
+static constexpr size_t PipelineDepth = 64;
+
+/// parseItems - The -pipeline parser thread's loop: parse the rest of the current
+/// input and queue every top-level item, with the arena its nodes live in.
+void CompilationSession::parseItems(SPSCQueue<TopLevelItem>& Queue){
+    while(TheParser.CurTok != tok_eof){
+        TopLevelItem Item;
+        {
+            PhaseScope Phase(TheTimers.get(), phase_parse);
+            switch(TheParser.CurTok){
+                case ';': // ignore top-level semicolons.
+                    TheParser.getNextToken();
+                    continue;
+                case tok_def:
+                    Item.Kind = TopLevelItem::Definition;
+                    Item.Function = TheParser.ParseDefinition();
+                    break;
+                case tok_extern:
+                    Item.Kind = TopLevelItem::Extern;
+                    Item.Proto = TheParser.ParseExtern();
+                    break;
+                default:
+                    Item.Kind = TopLevelItem::Expression;
+                    Item.Function = TheParser.ParseTopLevelExpr();
+                    break;
+            }
+        }
+
+        if(!Item.Function && !Item.Proto){
+            // Skip token for error recovery.
+            TheParser.getNextToken();
+            TheParser.releaseAST();
+            continue;
+        }
+
+        Item.AST = TheParser.takeAST();
+        Queue.push(std::move(Item));
+    }
+}
+
+/// runPipelined - The -pipeline mode. A thread of its own lexes and parses the
+/// inputs, and this thread generates, compiles and runs the items in the order
+/// they were parsed, so each one sees everything defined before it, as in the
+/// REPL. The items go through a bounded lock-free queue, so the parser can only
+/// get PipelineDepth items ahead.
+///
+/// Only the parser thread touches the lexer and the parser, including the user
+/// defined operators and what is known to be pure. Only this thread touches the
+/// prototypes, modules and the JIT. They share the symbol table, which the parser
+/// adds to while this thread reads the names of the IDs it was handed (see
+/// SymbolTable), and the -time-phases timers, of which the parser thread only
+/// runs the parse timer and this thread all the others. Parse errors are
+/// reported as the parser finds them, so they may come before the output of
+/// earlier items.
+bool CompilationSession::runPipelined(ArrayRef<std::string> Inputs){
+    SPSCQueue<TopLevelItem> Queue(PipelineDepth);
+    bool OpenedInputs = true;
+
+    std::thread ParserThread([&](){
+        ThreadTraceScope Trace;
+        for(const auto& Filename : Inputs){
+            if(!TheLexer.openSource(Filename)){
+                OpenedInputs = false;
+                break;
+            }
+            TheParser.getNextToken();
+            parseItems(Queue);
+        }
+        Queue.push(TopLevelItem());
+    });
+
+    while(true){
+        TopLevelItem Item = Queue.pop();
+        if(Item.Kind == TopLevelItem::EndOfInput)
+            break;
+
+        switch(Item.Kind){
+            case TopLevelItem::Definition:
+                checkJITError(defineFunction(std::move(Item.Function)));
+                break;
+            case TopLevelItem::Extern:
+                declareExtern(std::move(Item.Proto));
+                break;
+            default:
+                checkJITError(evaluateTopLevelExpression(*Item.Function));
+                break;
+        }
+        // The item's AST is released with it.
+    }
+    ParserThread.join();
+
+    return OpenedInputs && (!CompileOnly || emitOutputFile());
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of pipelined compilation
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Tiered compilation
+//------------------------------------------------------------------------------------------------------//
+
+/// instrumentForTierUp - Make F, a definition about to go to the JIT with only the
+/// quick passes run over it, the tier 0 of a -tiered function. The module is
+/// kept as bitcode first, then F counts its calls and which way its branches go,
+/// and its TierUpCalls'th call hands it to tierUp.
+void CompilationSession::instrumentForTierUp(Function& F){
+    TierZero.push_back(std::make_unique<TieredFunction>());
+    TieredFunction* TF = TierZero.back().get();
+    TF->Name = F.getName().str();
+    CurrentTierZero[TF->Name] = TF;
+    {
+        raw_svector_ostream OS(TF->Bitcode);
+        WriteBitcodeToFile(*F.getParent(), OS);
+    }
+
+    // compileTierUp finds the branches in the bitcode in the same order.
+    SmallVector<BranchInst*, 8> Branches;
+    for(BasicBlock& BB : F)
+        if(auto* BI = dyn_cast<BranchInst>(BB.getTerminator()))
+            if(BI->isConditional())
+                Branches.push_back(BI);
+    TF->NumCounters = 1 + 2 * Branches.size();
+    TF->Counters.reset(new uint64_t[TF->NumCounters]());
+
+    IRBuilder<> B(F.getContext());
+    Type* CountTy = B.getInt64Ty();
+    Constant* Counters = ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)TF->Counters.get()), CountTy->getPointerTo());
+    auto Bump = [&](Value* Idx){
+        Value* Ptr = B.CreateInBoundsGEP(CountTy, Counters, Idx);
+        Value* Count = B.CreateAdd(B.CreateLoad(CountTy, Ptr), B.getInt64(1));
+        B.CreateStore(Count, Ptr);
+        return Count;
+    };
+
+    for(unsigned I = 0, E = Branches.size(); I != E; ++I){
+        B.SetInsertPoint(Branches[I]);
+        Bump(B.CreateSelect(Branches[I]->getCondition(), B.getInt64(1 + 2 * I), B.getInt64(2 + 2 * I)));
+    }
+
+    // Count the call after the stack slots, which have to stay in the entry block.
+    BasicBlock& Entry = F.getEntryBlock();
+    auto BodyStart = Entry.begin();
+    while(isa<AllocaInst>(*BodyStart))
+        ++BodyStart;
+    BasicBlock* Body = Entry.splitBasicBlock(BodyStart, "body");
+    BasicBlock* TierUpBB = BasicBlock::Create(F.getContext(), "tierup", &F, Body);
+    Entry.getTerminator()->eraseFromParent();
+
+    B.SetInsertPoint(&Entry);
+    Value* Calls = Bump(B.getInt64(0));
+    B.CreateCondBr(B.CreateICmpEQ(Calls, B.getInt64(TierUpCalls)), TierUpBB, Body);
+
+    B.SetInsertPoint(TierUpBB);
+    Type* PtrTy = B.getInt8PtrTy();
+    FunctionCallee Hook = F.getParent()->getOrInsertFunction("kaleidoscope.tierup", B.getVoidTy(), PtrTy, PtrTy);
+    B.CreateCall(Hook, {ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)this), PtrTy),
+                        ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)TF), PtrTy)});
+    B.CreateBr(Body);
+}
+
+/// tierUp - Called by tier 0 code once it is hot, on the thread running it. The
+/// recompilation runs on the tier up thread, which leaves the result in TieredUp:
+/// errors can't be reported from there, so they wait for installTierUps as well.
+void CompilationSession::tierUp(CompilationSession* Session, TieredFunction* TF){
+    JITTargetMachineBuilder JTMB = Session->TheJIT->getTargetMachineBuilder();
+    JTMB.setCodeGenOptLevel(CodeGenOpt::Aggressive);
+    Session->TierUpPool->async([Session, TF, JTMB](){
+        auto Obj = Session->compileTierUp(*TF, JTMB);
+        std::lock_guard<std::mutex> Guard(Session->TieredUpLock);
+        Session->TieredUp.push_back({TF, std::move(Obj)});
+    });
+}
+
+/// compileTierUp - Compile a tier 0 function again from its bitcode, at -O3 and
+/// with its profile so far: its call count as the entry count, its branch counts
+/// as branch weights, and a profile summary saying how hot that is.
+Expected<std::unique_ptr<MemoryBuffer> > CompilationSession::compileTierUp(const TieredFunction& TF,
+                                                                          JITTargetMachineBuilder JTMB){
+    ThreadTraceScope Trace;
+    LLVMContext Ctx;
+    MemoryBufferRef Buf(StringRef(TF.Bitcode.data(), TF.Bitcode.size()), TF.Name);
+    auto MOrErr = parseBitcodeFile(Buf, Ctx);
+    if(!MOrErr)
+        return MOrErr.takeError();
+    std::unique_ptr<Module> M = std::move(*MOrErr);
+
+    // Only the definition itself moves up, with the internal functions it calls,
+    // and any map wrappers stay at tier 0.
+    Function* F = M->getFunction(TF.Name);
+    for(Function& Other : *M)
+        if(&Other != F && !Other.isDeclaration() && !Other.hasLocalLinkage())
+            Other.deleteBody();
+
+    // Tier 0 code keeps counting while this runs, so take one copy of the counters.
+    InstrProfRecord Profile;
+    Profile.Counts.assign(TF.Counters.get(), TF.Counters.get() + TF.NumCounters);
+    F->setEntryCount(Function::ProfileCount(Profile.Counts[0], Function::PCT_Real));
+
+    MDBuilder MDB(Ctx);
+    unsigned Branch = 0;
+    for(BasicBlock& BB : *F){
+        auto* BI = dyn_cast<BranchInst>(BB.getTerminator());
+        if(!BI || !BI->isConditional())
+            continue;
+        uint64_t Taken = Profile.Counts[1 + 2 * Branch];
+        uint64_t NotTaken = Profile.Counts[2 + 2 * Branch];
+        uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+        BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(Taken / Scale, NotTaken / Scale));
+        ++Branch;
+    }
+
+    InstrProfSummaryBuilder Summary(ProfileSummaryBuilder::DefaultCutoffs);
+    Summary.addRecord(Profile);
+    M->setProfileSummary(Summary.getSummary()->getMD(Ctx), ProfileSummary::PSK_Instr);
+
+    auto TM = JTMB.createTargetMachine();
+    if(!TM)
+        return TM.takeError();
+    optimizeModule(*M, TM->get(), nullptr, OptimizationLevel::O3);
+    SimpleCompiler Compile(**TM);
+    return Compile(*M);
+}
+
+/// installTierUps - Point the stubs of the functions recompiled so far at their new
+/// code. Only called between top-level items, when no JIT'd code is running, since
+/// the tier 0 code is freed. A function defined again in the meantime keeps its
+/// new definition. The errors of those that failed are returned together.
+Error CompilationSession::installTierUps(){
+    std::vector<std::pair<TieredFunction*, Expected<std::unique_ptr<MemoryBuffer> > > > Finished;
+    {
+        std::lock_guard<std::mutex> Guard(TieredUpLock);
+        Finished.swap(TieredUp);
+    }
+
+    Error Errors = Error::success();
+    for(auto& TieredFn : Finished){
+        auto CI = CurrentTierZero.find(TieredFn.first->Name);
+        if(CI == CurrentTierZero.end() || CI->second != TieredFn.first){
+            consumeError(TieredFn.second.takeError());
+            continue;
+        }
+        CurrentTierZero.erase(CI);
+        if(!TieredFn.second){
+            Errors = joinErrors(std::move(Errors), TieredFn.second.takeError());
+            continue;
+        }
+        if(auto Err = TheJIT->addRedefinableObjectFile(std::move(*TieredFn.second))){
+            Errors = joinErrors(std::move(Errors), std::move(Err));
+            continue;
+        }
+        ++NumTierUps;
+    }
+    return Errors;
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of tiered compilation
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Benchmarks
+//------------------------------------------------------------------------------------------------------//
+
+// The benchmarks are a mode of the driver, -benchmark, rather than a target of
+// their own. The lexer, parser and code generator they time are internal to this
+// file, and behind KaleidoscopeEngine there is only compiling and running as a
+// whole. There is also no build description to add a target or a benchmark
+// library to. They are only compiled along with main, so an embedding build
+// doesn't carry them.
+
+#ifndef KALEIDOSCOPE_NO_MAIN
+static const char* const WorkloadNames[] = {"", "wide", "nested", "chain", "calls"};
+
+/// generateWorkload - Kaleidoscope source of one -benchmark shape. Each workload
+/// ends in a top-level expression, so the JIT has a first result to produce.
+static std::string generateWorkload(BenchmarkWorkload Workload, unsigned Size){
+    std::string Source;
+    raw_string_ostream OS(Source);
+    switch(Workload){
+        case bench_wide:
+            // Many small definitions, like a library of helpers.
+            for(unsigned I = 0; I != Size; ++I)
+                OS << "def f" << I << "(a b c) a * b + c - a / (b + " << I << ");\n";
+            OS << "1 + 2;\n";
+            break;
+        case bench_nested:
+            // (x + (x * (x - ... x))) nested Size deep.
+            OS << "def nested(x) ";
+            for(unsigned I = 0; I != Size; ++I)
+                OS << "(x " << "+*-"[I % 3] << ' ';
+            OS << 'x' << std::string(Size, ')') << ";\n";
+            OS << "1 + 2;\n";
+            break;
+        case bench_chain:
+            // x + y * x - y ... with Size operators, at mixed precedence.
+            OS << "def chain(x y) x";
+            for(unsigned I = 0; I != Size; ++I)
+                OS << ' ' << "+*-"[I % 3] << ' ' << "yx"[I % 2];
+            OS << ";\n";
+            OS << "1 + 2;\n";
+            break;
+        case bench_calls:
+            // Every use of a user defined operator is a call to its definition.
+            OS << "def binary@ 50 (a b) a * b + 1;\n";
+            OS << "def unary~(v) v * 0.5 - 1;\n";
+            for(unsigned I = 0; I != Size; ++I)
+                OS << "def g" << I << "(a b) ~(a @ b) @ (b @ " << I << ") - ~a;\n";
+            OS << "~(1 @ 2) @ 3;\n";
+            break;
+        default:
+            llvm_unreachable("not a single workload");
+    }
+    return OS.str();
+}
+
+static double getWallTime(){
+    return TimeRecord::getCurrentTime(/*Start*/ true).getWallTime();
+}
+
+/// BenchmarkResult - The fastest run of one measurement, and how many items
+/// (tokens, nodes, functions) each run handled.
+struct BenchmarkResult{
+    double Seconds = HUGE_VAL;
+    uint64_t Count = 0;
+
+    void addRun(double RunSeconds, uint64_t RunCount){
+        if(RunSeconds < Seconds){
+            Seconds = RunSeconds;
+            Count = RunCount;
+        }
+    }
+};
+
+/// BenchmarkInput - A fresh symbol table, lexer and parser reading the workload,
+/// so no measurement sees state left behind by another.
+struct BenchmarkInput{
+    SymbolTable Symbols;
+    Lexer Lex;
+    Parser P;
+    PrototypeMap Protos;
+    std::vector<std::unique_ptr<FunctionAST> > Definitions;
+    std::vector<std::unique_ptr<FunctionAST> > TopLevelExprs;
+
+    explicit BenchmarkInput(StringRef Source) : Lex(Symbols), P(Lex, Symbols){
+        Lex.openBuffer(MemoryBuffer::getMemBuffer(Source, "benchmark", /*RequiresNullTerminator*/ false));
+    }
+
+    void parse() {parseInput(P, Protos, Definitions, TopLevelExprs);}
+};
+
+/// benchmarkLexer - Tokens per second for gettok alone.
+static void benchmarkLexer(StringRef Source, BenchmarkResult& Result){
+    BenchmarkInput Input(Source);
+    double Start = getWallTime();
+    uint64_t Tokens = 0;
+    while(Input.Lex.gettok() != tok_eof)
+        ++Tokens;
+    Result.addRun(getWallTime() - Start, Tokens);
+}
+
+/// benchmarkParser - Expression nodes per second for lexing and parsing.
+static void benchmarkParser(StringRef Source, BenchmarkResult& Result){
+    BenchmarkInput Input(Source);
+    uint64_t Nodes = NumASTNodes.getValue();
+    double Start = getWallTime();
+    Input.parse();
+    Result.addRun(getWallTime() - Start, NumASTNodes.getValue() - Nodes);
+}
+
+/// benchmarkCodeGen - Definitions per second through IR generation, verification
+/// and function optimization, all into one module.
+static void benchmarkCodeGen(StringRef Source, TargetMachine& TM, BenchmarkResult& Result){
+    BenchmarkInput Input(Source);
+    Input.parse();
+
+    CodeGen CG(Input.Symbols, Input.Protos, TM.createDataLayout(), TM.getTargetTriple(), &TM);
+    double Start = getWallTime();
+    for(auto& FnAST : Input.Definitions)
+        FnAST->codegen(CG);
+    Result.addRun(getWallTime() - Start, Input.Definitions.size());
+}
+
+/// benchmarkFirstResult - Time from the source text to the value of its first
+/// top-level expression: parsing, JIT set up, IR generation for everything, and
+/// native code for whatever the JIT compiles up front.
+static bool benchmarkFirstResult(StringRef Source, BenchmarkResult& Result, double& Value){
+    double Start = getWallTime();
+    BenchmarkInput Input(Source);
+    Input.parse();
+
+    auto JIT = ExitOnErr(KaleidoscopeJIT::Create(LazyCompile));
+    JITTargetMachineBuilder JTMB = JIT->getTargetMachineBuilder();
+    auto TM = ExitOnErr(JTMB.createTargetMachine());
+    const DataLayout& DL = JIT->getDataLayout();
+
+    CodeGen CG(Input.Symbols, Input.Protos, DL, TM->getTargetTriple(), TM.get());
+    for(auto& FnAST : Input.Definitions)
+        FnAST->codegen(CG);
+    ExitOnErr(JIT->addModule(CG.takeModule()));
+
+    if(Input.TopLevelExprs.empty() || !Input.TopLevelExprs.front()->codegen(CG)){
+        std::cerr << "Error: the workload has no top-level expression to run" << std::endl;
+        return false;
+    }
+    ExitOnErr(JIT->addEagerModule(CG.takeModule()));
+
+    auto ExprSymbol = ExitOnErr(JIT->lookup("__anon_expr"));
+    Value = ((double (*)())(intptr_t)ExprSymbol.getAddress())();
+    Result.addRun(getWallTime() - Start, 1);
+    return true;
+}
+
+static void printBenchmarkResult(const char* Name, const BenchmarkResult& Result, const char* Unit){
+    outs() << format("  %-12s %10llu %-10s %10.3f ms %14.0f %s/s\n", Name, (unsigned long long)Result.Count, Unit,
+                     Result.Seconds * 1e3, Result.Count / Result.Seconds, Unit);
+}
+
+/// runBenchmarks - The -benchmark mode. Every measurement is repeated and the
+/// fastest run reported, which is the least disturbed by the rest of the system.
+static bool runBenchmarks(){
+    auto TM = ExitOnErr(ExitOnErr(JITTargetMachineBuilder::detectHost()).createTargetMachine());
+
+    for(unsigned W = bench_wide; W != bench_all; ++W){
+        auto Workload = (BenchmarkWorkload)W;
+        if(Benchmark != bench_all && Benchmark != Workload)
+            continue;
+
+        std::string Source = generateWorkload(Workload, BenchmarkSize);
+        BenchmarkResult Lexing, Parsing, Generating, FirstResult;
+        double Value = 0;
+        for(unsigned Run = 0; Run < std::max(1u, (unsigned)BenchmarkRepetitions); ++Run){
+            benchmarkLexer(Source, Lexing);
+            benchmarkParser(Source, Parsing);
+            benchmarkCodeGen(Source, *TM, Generating);
+            if(!benchmarkFirstResult(Source, FirstResult, Value))
+                return false;
+        }
+
+        outs() << WorkloadNames[Workload] << ": size " << BenchmarkSize << ", "
+               << format("%.1f", Source.size() / 1024.0) << " KiB of source\n";
+        printBenchmarkResult("lex", Lexing, "tokens");
+        printBenchmarkResult("parse", Parsing, "nodes");
+        printBenchmarkResult("codegen", Generating, "functions");
+        outs() << format("  first result %10.3f ms to %g (%s JIT)\n", FirstResult.Seconds * 1e3, Value,
+                         LazyCompile ? "lazy" : "eager");
+    }
+    return true;
+}
+#endif // KALEIDOSCOPE_NO_MAIN
+
+//------------------------------------------------------------------------------------------------------//
+// End of benchmarks
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Embedding
+//------------------------------------------------------------------------------------------------------//
+
+/// ErrorLogScope - Send what LogError reports on this thread to Log for as long as
+/// the scope lasts.
+class ErrorLogScope{
+    private:
+        std::string* Saved;
+
+    public:
+        explicit ErrorLogScope(std::string* Log) : Saved(ErrorLog) {ErrorLog = Log;}
+        ~ErrorLogScope() {ErrorLog = Saved;}
+
+        ErrorLogScope(const ErrorLogScope&) = delete;
+        ErrorLogScope& operator=(const ErrorLogScope&) = delete;
+};
+
+KaleidoscopeEngine::KaleidoscopeEngine() : Session(std::make_unique<CompilationSession>(/*Embedded*/ true)) {}
+
+KaleidoscopeEngine::~KaleidoscopeEngine(){
+    // Whatever the JIT reports while shutting down has nowhere to go.
+    std::string Log;
+    ErrorLogScope Scope(&Log);
+    Session.reset();
+}
+
+std::unique_ptr<KaleidoscopeEngine> KaleidoscopeEngine::create(std::string* Error){
+    static std::once_flag TargetsInitialized;
+    std::call_once(TargetsInitialized, [](){
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    });
+
+    std::string Log;
+    ErrorLogScope Scope(&Log);
+    std::unique_ptr<KaleidoscopeEngine> Engine(new KaleidoscopeEngine());
+    if(!Engine->Session->initialize()){
+        if(Error)
+            *Error = Log;
+        return nullptr;
+    }
+    return Engine;
+}
+
+bool KaleidoscopeEngine::compile(std::string_view Source, std::vector<double>* Results, std::string* Errors){
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    std::string Log;
+    {
+        ErrorLogScope Scope(&Log);
+        Session->compileSource(StringRef(Source.data(), Source.size()), Results);
+    }
+    if(Errors)
+        *Errors = Log;
+    return Log.empty();
+}
+
+void* KaleidoscopeEngine::lookupAddress(std::string_view Name, const ValueType* ArgTypes, size_t NumArgs,
+                                        ValueType ReturnType, std::string* Error){
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    std::string Log;
+    void* Address;
+    {
+        ErrorLogScope Scope(&Log);
+        Address = Session->lookupFunction(StringRef(Name.data(), Name.size()), makeArrayRef(ArgTypes, NumArgs),
+                                          ReturnType);
+    }
+    if(Error)
+        *Error = Log;
+    return Address;
+}
+
+MemoryStats KaleidoscopeEngine::getMemoryStats(){
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    return Session->getMemoryStats();
+}
+
+bool KaleidoscopeEngine::runBatch(std::string_view Name, const double* const* Columns, size_t NumColumns, double* Out,
+                                  uint64_t N, std::string* Error){
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    std::lock_guard<std::mutex> BatchGuard(BatchLock);
+    std::string Log;
+    bool Succeeded;
+    {
+        ErrorLogScope Scope(&Log);
+        Succeeded = Session->runMap(StringRef(Name.data(), Name.size()), makeArrayRef(Columns, NumColumns), Out, N);
+    }
+    if(Error)
+        *Error = Log;
+    return Succeeded;
+}
+
+//------------------------------------------------------------------------------------------------------//
+// End of embedding
+//------------------------------------------------------------------------------------------------------//
+
+//------------------------------------------------------------------------------------------------------//
+// Main driver code.
+//------------------------------------------------------------------------------------------------------//
+
+/// createCodeGenTarget - A new TargetMachine for the code being generated: the
+/// JIT's host target, or the -c output's. Every thread generating code needs its own.
+std::unique_ptr<TargetMachine> CompilationSession::createCodeGenTarget(){
+    if(CompileOnly)
+        return createTargetMachine();
+
+    JITTargetMachineBuilder JTMB = TheJIT->getTargetMachineBuilder();
+    auto TM = JTMB.createTargetMachine();
+    if(!TM){
+        checkJITError(TM.takeError());
+        return nullptr;
+    }
+    return std::move(*TM);
+}
+
+/// initialize - Create the JIT (or the target to compile for), then make the
+/// module, which holds all the code.
+bool CompilationSession::initialize(){
+    if(TimePhases){
+        TheTimers = std::make_unique<PhaseTimers>();
+        ThePassTimer = std::make_unique<TimePassesHandler>(/*Enabled*/ true);
+        EnableStatistics(/*DoPrintOnExit*/ false);
+    }
+
+    if(!CompileOnly){
+        auto JIT = KaleidoscopeJIT::Create(LazyCompile && !Embedded);
+        if(!JIT)
+            return checkJITError(JIT.takeError());
+        TheJIT = std::move(*JIT);
+        // What the JIT reports besides the errors it returns goes with them.
+        if(Embedded)
+            TheJIT->setErrorReporter([](Error Err){ LogError(toString(std::move(Err)).c_str()); });
+
+        for(const HostFunction& Fn : getHostFunctions())
+            if(!checkJITError(TheJIT->defineHostSymbol(Fn.Name, Fn.Address)))
+                return false;
+        if(!CacheDir.empty())
+            TheCache = std::make_unique<ObjectFileCache>(CacheDir);
+        // Libraries compiled with -memoize need it even if this run isn't.
+        if(!checkJITError(TheJIT->defineHostSymbol(MemoGenerationName, pointerToJITTargetAddress(&MemoGeneration),
+                                                   /*Callable*/ false)))
+            return false;
+        if(Tiered){
+            if(!checkJITError(TheJIT->defineHostSymbol("kaleidoscope.tierup", pointerToJITTargetAddress(&tierUp))))
+                return false;
+            TierUpPool = std::make_unique<ThreadPool>(hardware_concurrency(1));
+        }
+    }
+
+    for(const auto& Path : LibraryFiles)
+        if(!loadLibrary(Path))
+            return false;
+
+    TheTargetMachine = createCodeGenTarget();
+    if(!TheTargetMachine)
+        return false;
+    TheDataLayout = TheTargetMachine->createDataLayout();
+    TheTriple = TheTargetMachine->getTargetTriple();
+
+    InitializeModule();
+    return true;
+}
+
+bool CompilationSession::run(ArrayRef<std::string> Inputs){
+    if(NumThreads != 1)
+        return compileInParallel(Inputs);
+    if(Pipeline)
+        return runPipelined(Inputs);
+
+    for(const auto& Filename : Inputs){
+        if(!TheLexer.openSource(Filename))
+            return false;
+
+        // Prime the first token.
+        if(!CompileOnly)
+            std::cout << "ready> ";
+        TheParser.getNextToken();
+
+        // run the main "interpreter loop" now.
+        MainLoop();
+    }
+
+    return !CompileOnly || emitOutputFile();
+}
+
+/// printTimingReport - The -time-phases report: time per phase, time per pass
+/// and the statistics, written to -info-output-file (stderr by default).
+void CompilationSession::printTimingReport(){
+    std::unique_ptr<raw_ostream> OS = CreateInfoOutputFile();
+    TheTimers->print(*OS);
+    ThePassTimer->setOutStream(*OS);
+    ThePassTimer->print();
+    PrintStatistics(*OS);
+}
+
+#ifndef KALEIDOSCOPE_NO_MAIN
+/// printMemoryStats - The -memory-stats report, written to stderr.
+void CompilationSession::printMemoryStats() const{
+    MemoryStats Stats = getMemoryStats();
+    errs() << "Memory:\n"
+           << format("  AST arena     %12" PRIu64 " bytes (largest item %" PRIu64 ")\n", Stats.ASTBytes,
+                     Stats.PeakASTBytes)
+           << format("  JIT code      %12" PRIu64 " bytes\n", Stats.JITCodeBytes)
+           << format("  JIT data      %12" PRIu64 " bytes\n", Stats.JITDataBytes)
+           << format("  heap in use   %12" PRIu64 " bytes\n", Stats.HeapBytes)
+           << format("  LLVM contexts %12u started\n", (unsigned)NumContexts);
+}
+
+int main(int argc, char* argv[]){
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+    if(OptLevel < '0' || OptLevel > '3'){
+        std::cerr << "Invalid optimization level: -O" << OptLevel << std::endl;
+        return 1;
+    }
+    if(Tiered && TierUpCalls == 0){
+        std::cerr << "-tier-up-calls must be at least 1" << std::endl;
+        return 1;
+    }
+    if(Tiered && (NumThreads != 1 || !CacheDir.empty())){
+        std::cerr << "-tiered can't be combined with -j or -cache-dir" << std::endl;
+        return 1;
+    }
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    if(Benchmark != bench_none)
+        return runBenchmarks() ? 0 : 1;
+
+    std::vector<std::string> Inputs(InputFilenames.begin(), InputFilenames.end());
+    if(Inputs.empty())
+        Inputs.push_back("-");
+
+    if(TimeTrace)
+        timeTraceProfilerInitialize(TimeTraceGranularity, argv[0]);
+
+    bool Succeeded;
+    {
+        CompilationSession Session;
+        Succeeded = Session.initialize() && Session.run(Inputs);
+        if(TimePhases)
+            Session.printTimingReport();
+        if(PrintMemoryStats)
+            Session.printMemoryStats();
+    }
+
+    if(TimeTrace){
+        if(auto Err = timeTraceProfilerWrite(TimeTraceFile, "kaleidoscope")){
+            std::cerr << "Error: " << toString(std::move(Err)) << std::endl;
+            Succeeded = false;
+        }
+        timeTraceProfilerCleanup();
+    }
 
-    return 0;
+    return Succeeded ? 0 : 1;
 }
+#endif // KALEIDOSCOPE_NO_MAIN
@@ -0,0 +1,115 @@
+// Embedding the Kaleidoscope JIT in a host program
+
+#ifndef KALEIDOSCOPEENGINE_H
+#define KALEIDOSCOPEENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ValueType - The types an argument, result or variable can be declared with,
+/// as in "def f(n:i64 x:f32):f32". Anything not annotated is an f64. Values of
+/// '<' are an i1, which can't be declared and turns into whatever type it is
+/// combined with, as 0 or 1.
+enum ValueType : uint8_t {
+    vt_f64,
+    vt_f32,
+    vt_i64,
+    vt_infer    // Variables only: the type of the initializer.
+};
+
+/// ValueTypeOf - The ValueType of the C++ type T, for the signatures lookup takes.
+template<typename T> struct ValueTypeOf;
+template<> struct ValueTypeOf<double>{ static constexpr ValueType Type = vt_f64; };
+template<> struct ValueTypeOf<float>{ static constexpr ValueType Type = vt_f32; };
+template<> struct ValueTypeOf<int64_t>{ static constexpr ValueType Type = vt_i64; };
+
+/// FunctionSignature - The argument and result types of the function type Sig.
+template<typename Sig> struct FunctionSignature;
+template<typename Ret, typename... Args>
+struct FunctionSignature<Ret(Args...)>{
+    static constexpr size_t NumArgs = sizeof...(Args);
+    static constexpr ValueType ArgTypes[sizeof...(Args) + 1] = {ValueTypeOf<Args>::Type..., vt_f64};
+    static constexpr ValueType ReturnType = ValueTypeOf<Ret>::Type;
+};
+
+/// MemoryStats - What a session is holding on to, in bytes.
+struct MemoryStats{
+    uint64_t ASTBytes;          // The parser's arena, between items.
+    uint64_t PeakASTBytes;      // The most any one item's nodes took.
+    uint64_t JITCodeBytes;      // Machine code of the functions the JIT holds.
+    uint64_t JITDataBytes;      // Their constants and data.
+    uint64_t HeapBytes;         // All of the process's heap, IR and contexts included.
+};
+
+class CompilationSession;
+
+/// KaleidoscopeEngine - The compiler and JIT of the kaleidoscope driver, for use
+/// inside another program: source goes in as a string, and what it defines comes
+/// back as native function pointers. Every engine is a session of its own, with
+/// its own symbol table, functions and JIT, so any number of them can be used
+/// side by side in one process.
+///
+/// compile runs alone, while any number of threads may look functions up, call
+/// them and run batches at once. Definitions are compiled to native code before
+/// compile returns, so calls never have to wait for the compiler. A function
+/// pointer stays valid for as long as the engine does, and defining the function
+/// again points it at the new body. That must not happen while another thread is
+/// still running the old one.
+///
+/// Errors never go to the console: a method that fails returns false or null
+/// and, if asked for, leaves a line for each error in a string.
+class KaleidoscopeEngine{
+    private:
+        std::unique_ptr<CompilationSession> Session;
+        std::shared_mutex Lock;    // Held alone by compile, shared by the rest.
+        std::mutex BatchLock;      // The batch runtime runs one job at a time.
+
+        KaleidoscopeEngine();
+
+        void* lookupAddress(std::string_view Name, const ValueType* ArgTypes, size_t NumArgs, ValueType ReturnType,
+                            std::string* Error);
+
+    public:
+        ~KaleidoscopeEngine();
+
+        KaleidoscopeEngine(const KaleidoscopeEngine&) = delete;
+        KaleidoscopeEngine& operator=(const KaleidoscopeEngine&) = delete;
+
+        /// create - Start an engine with a JIT for the host, or return null.
+        static std::unique_ptr<KaleidoscopeEngine> create(std::string* Error = nullptr);
+
+        /// compile - Handle every definition, extern and top-level expression of
+        /// Source in order, as the REPL would. The values of the expressions are
+        /// appended to Results if given. Returns false if any item failed, the
+        /// others still take effect.
+        bool compile(std::string_view Source, std::vector<double>* Results = nullptr, std::string* Errors = nullptr);
+
+        /// lookup - The function Name as a pointer of type Sig*, for a Sig such as
+        /// double(double, int64_t), or null if there is no such function or it
+        /// takes or returns other types than Sig does.
+        template<typename Sig>
+        Sig* lookup(std::string_view Name, std::string* Error = nullptr){
+            typedef FunctionSignature<Sig> Signature;
+            return reinterpret_cast<Sig*>(lookupAddress(Name, Signature::ArgTypes, Signature::NumArgs,
+                                                        Signature::ReturnType, Error));
+        }
+
+        /// runBatch - Set Out[i] = Name(Columns[0][i], Columns[1][i], ...) for every
+        /// i < N, on every core, through the vectorized NAME.map entry point every
+        /// definition gets. The columns and results are doubles whatever Name's
+        /// types are, converted as by a call. Batches run one at a time.
+        bool runBatch(std::string_view Name, const double* const* Columns, size_t NumColumns, double* Out, uint64_t N,
+                      std::string* Error = nullptr);
+
+        /// getMemoryStats - How much memory the engine holds, for keeping an eye on
+        /// a long running one. The heap is that of the whole process.
+        MemoryStats getMemoryStats();
+};
+
+#endif // KALEIDOSCOPEENGINE_H
@@ -0,0 +1,387 @@
+// Simple ORC based JIT for the Kaleidoscope driver
+
+#ifndef KALEIDOSCOPEJIT_H
+#define KALEIDOSCOPEJIT_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ObjectFileInterface.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/raw_ostream.h"
+#include "KaleidoscopeLibrary.h"
+
+namespace llvm{
+namespace orc{
+
+    /// JITMemoryUsage - Bytes of code and of data the JIT currently holds for the
+    /// objects linked into it.
+    struct JITMemoryUsage{
+        std::atomic<uint64_t> CodeBytes{0};
+        std::atomic<uint64_t> DataBytes{0};
+    };
+
+    /// CountingMemoryManager - A SectionMemoryManager that keeps Usage up to date
+    /// with the sections it allocated, for as long as it holds them. The object
+    /// layer makes one per object and destroys it when the object is removed.
+    class CountingMemoryManager : public SectionMemoryManager{
+        private:
+            JITMemoryUsage& Usage;
+            uint64_t CodeBytes = 0;
+            uint64_t DataBytes = 0;
+
+        public:
+            explicit CountingMemoryManager(JITMemoryUsage& Usage) : Usage(Usage) {}
+
+            ~CountingMemoryManager() override{
+                Usage.CodeBytes -= CodeBytes;
+                Usage.DataBytes -= DataBytes;
+            }
+
+            uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+                                         StringRef SectionName) override{
+                CodeBytes += Size;
+                Usage.CodeBytes += Size;
+                return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID, SectionName);
+            }
+
+            uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+                                         StringRef SectionName, bool IsReadOnly) override{
+                DataBytes += Size;
+                Usage.DataBytes += Size;
+                return SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, IsReadOnly);
+            }
+    };
+
+    /// KaleidoscopeJIT - Compiles each module handed to it down to native code
+    /// in the current process. Symbols that are not defined by any added module
+    /// are looked up in the libraries added with addLibrary and then resolved
+    /// against the host: first the ones bound with defineHostSymbol, then
+    /// everything else the process exports.
+    ///
+    /// A lazy JIT puts a compile-on-demand layer in front of the compiler: added
+    /// modules stay as IR behind call-through stubs, and each function is only
+    /// compiled the first time it is called.
+    ///
+    /// Functions added with addRedefinableModule or addRedefinableObjectFile can be
+    /// defined again. Each such module gets a JITDylib of its own, and the main
+    /// JITDylib only holds a stub for every function, pointing at its newest body.
+    /// Library functions get the same stubs, so they can be redefined as well.
+    class KaleidoscopeJIT{
+        private:
+            std::unique_ptr<ExecutionSession> ES;
+
+            JITTargetMachineBuilder JTMB;
+            DataLayout DL;
+            MangleAndInterner Mangle;
+
+            JITMemoryUsage MemoryUsage;     // Before ObjectLayer, which updates it until it goes.
+            RTDyldObjectLinkingLayer ObjectLayer;
+            IRCompileLayer CompileLayer;
+            IRCompileLayer QuickCompileLayer;   // Without backend optimization.
+
+            std::unique_ptr<LazyCallThroughManager> LCTM;   // Lazy functions and library functions.
+            std::unique_ptr<CompileOnDemandLayer> CODLayer; // Null unless lazy.
+
+            JITDylib& MainJD;
+
+            /// LibraryJD - The functions of every library, each defined the first time
+            /// it is looked up, as a stub like those of redefinable functions. Searched
+            /// after MainJD, and library code calls other functions through the stubs,
+            /// so redefining a library function replaces it for library code too.
+            JITDylib& LibraryJD;
+
+            /// HostJD - The host symbols, searched last, so a function added to the JIT
+            /// takes the place of a host symbol by the same name.
+            JITDylib& HostJD;
+
+            /// LibraryBodiesJD - The bodies behind the stubs of LibraryJD, each compiled
+            /// the first time its function is called.
+            JITDylib& LibraryBodiesJD;
+
+            /// ISM - The stubs callers go through to reach redefinable functions.
+            std::unique_ptr<IndirectStubsManager> ISM;
+
+            /// CurrentDefinitions - The JITDylib holding the newest body of each
+            /// redefinable function. NumCurrent counts the functions each of those
+            /// JITDylibs still has the newest body of; one that has none left is removed.
+            DenseMap<SymbolStringPtr, JITDylib*> CurrentDefinitions;
+            DenseMap<JITDylib*, unsigned> NumCurrent;
+            unsigned NumDefinitionDylibs = 0;
+
+        public:
+            KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES, JITTargetMachineBuilder JTMB, DataLayout DL,
+                            std::unique_ptr<LazyCallThroughManager> LCTM, bool Lazy = false)
+                : ES(std::move(ES)), JTMB(JTMB), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  ObjectLayer(*this->ES, [this](){ return std::make_unique<CountingMemoryManager>(MemoryUsage); }),
+                  CompileLayer(*this->ES, ObjectLayer, std::make_unique<ConcurrentIRCompiler>(JTMB)),
+                  QuickCompileLayer(*this->ES, ObjectLayer,
+                                    std::make_unique<ConcurrentIRCompiler>(withCodeGenOptLevel(JTMB, CodeGenOpt::None))),
+                  LCTM(std::move(LCTM)), MainJD(this->ES->createBareJITDylib("<main>")),
+                  LibraryJD(this->ES->createBareJITDylib("<libraries>")), HostJD(this->ES->createBareJITDylib("<host>")),
+                  LibraryBodiesJD(this->ES->createBareJITDylib("<library bodies>")),
+                  ISM(createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())()) {
+                if(Lazy)
+                    CODLayer = std::make_unique<CompileOnDemandLayer>(*this->ES, CompileLayer, *this->LCTM,
+                                                                      createLocalIndirectStubsManagerBuilder(
+                                                                          JTMB.getTargetTriple()));
+
+                HostJD.addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
+                MainJD.setLinkOrder(makeJITDylibSearchOrder({&LibraryJD, &HostJD}));
+                LibraryJD.setLinkOrder(makeJITDylibSearchOrder({&MainJD, &LibraryJD, &HostJD}),
+                                       /*LinkAgainstThisJITDylibFirst*/ false);
+                LibraryBodiesJD.setLinkOrder(makeJITDylibSearchOrder({&MainJD, &LibraryJD, &HostJD}));
+
+                if(JTMB.getTargetTriple().isOSBinFormatCOFF()){
+                    ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+                    ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+                }
+            }
+
+            ~KaleidoscopeJIT(){
+                if(auto Err = ES->endSession())
+                    ES->reportError(std::move(Err));
+            }
+
+            /// Create - Make a JIT for the host. With Lazy set, functions are compiled on first call.
+            static Expected<std::unique_ptr<KaleidoscopeJIT> > Create(bool Lazy = false){
+                auto EPC = SelfExecutorProcessControl::Create();
+                if(!EPC)
+                    return EPC.takeError();
+
+                auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+
+                // Code only ever runs in this process, so compile for the host CPU and
+                // all of its features.
+                auto JTMBOrErr = JITTargetMachineBuilder::detectHost();
+                if(!JTMBOrErr)
+                    return JTMBOrErr.takeError();
+                JITTargetMachineBuilder JTMB = std::move(*JTMBOrErr);
+
+                auto DL = JTMB.getDefaultDataLayoutForTarget();
+                if(!DL)
+                    return DL.takeError();
+
+                // Library functions are compiled on first call even by an eager JIT.
+                auto LCTM = createLocalLazyCallThroughManager(JTMB.getTargetTriple(), *ES,
+                                                              pointerToJITTargetAddress(&handleLazyCallThroughError));
+                if(!LCTM)
+                    return LCTM.takeError();
+
+                return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB), std::move(*DL),
+                                                         std::move(*LCTM), Lazy);
+            }
+
+            const DataLayout& getDataLayout() const {return DL;}
+
+            /// getTargetMachineBuilder - Describes the host target, for code that wants
+            /// to compile objects itself before handing them to addObjectFile.
+            const JITTargetMachineBuilder& getTargetMachineBuilder() const {return JTMB;}
+
+            JITDylib& getMainJITDylib() {return MainJD;}
+
+            /// getMemoryUsage - The code and data of every object the JIT holds.
+            const JITMemoryUsage& getMemoryUsage() const {return MemoryUsage;}
+
+            /// addModule - Hand a module over to the JIT. If no tracker is given the
+            /// module lives until the JIT is destroyed. A lazy JIT only compiles each
+            /// function in it when it is first called.
+            Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr){
+                if(!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                if(CODLayer)
+                    return CODLayer->add(RT, std::move(TSM));
+                return CompileLayer.add(RT, std::move(TSM));
+            }
+
+            /// addEagerModule - Hand over a module that is about to run anyway, so it is
+            /// compiled straight away even by a lazy JIT.
+            Error addEagerModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr){
+                if(!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                return CompileLayer.add(RT, std::move(TSM));
+            }
+
+            /// addObjectFile - Hand an already compiled object file over to the JIT.
+            Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj, ResourceTrackerSP RT = nullptr){
+                if(!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                return ObjectLayer.add(RT, std::move(Obj));
+            }
+
+            /// addRedefinableModule - Hand over a module whose functions may be defined
+            /// again later. Callers reach them through stubs, so redefining a function
+            /// never needs its callers recompiled; the old body is freed once nothing
+            /// else in its module is current either. A lazy JIT compiles each body the
+            /// first time it is called. Quick code is compiled as fast as possible
+            /// rather than into fast code.
+            Error addRedefinableModule(ThreadSafeModule TSM, bool Quick = false){
+                SymbolFlagsMap Symbols;
+                TSM.withModuleDo([&](Module& M){
+                    for(Function& F : M)
+                        if(!F.isDeclaration() && !F.hasLocalLinkage())
+                            Symbols[Mangle(F.getName())] = JITSymbolFlags::fromGlobalValue(F);
+                });
+
+                JITDylib& JD = createDefinitionDylib();
+                if(auto Err = (Quick ? QuickCompileLayer : CompileLayer).add(JD, std::move(TSM)))
+                    return discardDefinitionDylib(JD, std::move(Err));
+                return redirectStubs(JD, Symbols);
+            }
+
+            /// addRedefinableObjectFile - addRedefinableModule for an already compiled
+            /// object file.
+            Error addRedefinableObjectFile(std::unique_ptr<MemoryBuffer> Obj){
+                auto Interface = getObjectFileInterface(*ES, Obj->getMemBufferRef());
+                if(!Interface)
+                    return Interface.takeError();
+
+                JITDylib& JD = createDefinitionDylib();
+                if(auto Err = ObjectLayer.add(JD, std::move(Obj)))
+                    return discardDefinitionDylib(JD, std::move(Err));
+                return redirectStubs(JD, Interface->SymbolFlags);
+            }
+
+            /// defineHostSymbol - Bind Name to the function, or with Callable false the
+            /// data, at Address in this process.
+            Error defineHostSymbol(StringRef Name, JITTargetAddress Address, bool Callable = true){
+                JITSymbolFlags Flags = JITSymbolFlags::Exported;
+                if(Callable)
+                    Flags |= JITSymbolFlags::Callable;
+                SymbolMap Symbols;
+                Symbols[Mangle(Name)] = JITEvaluatedSymbol(Address, Flags);
+                return HostJD.define(absoluteSymbols(std::move(Symbols)));
+            }
+
+            /// addLibrary - Make the functions of Lib callable, and redefinable. Nothing
+            /// is read from its bitcode until one of them is looked up, and then only
+            /// that function's body, which is compiled on its first call.
+            void addLibrary(std::unique_ptr<KaleidoscopeLibrary> Lib){
+                LibraryJD.addGenerator(std::make_unique<LibraryGenerator>(CompileLayer, *LCTM, *ISM, LibraryBodiesJD,
+                                                                          std::move(Lib), DL.getGlobalPrefix()));
+            }
+
+            /// setErrorReporter - Where the errors no caller gets back go, such as those a
+            /// failed compile reports on top of the one it returns. By default they are
+            /// printed to stderr.
+            void setErrorReporter(ExecutionSession::ErrorReporter ReportError){
+                ES->setErrorReporter(std::move(ReportError));
+            }
+
+            /// lookup - Find the address of a symbol, compiling whatever is needed to
+            /// produce it.
+            Expected<JITEvaluatedSymbol> lookup(StringRef Name){
+                return ES->lookup(makeJITDylibSearchOrder({&MainJD, &LibraryJD, &HostJD}), Mangle(Name.str()));
+            }
+
+        private:
+            static JITTargetMachineBuilder withCodeGenOptLevel(JITTargetMachineBuilder JTMB, CodeGenOpt::Level Level){
+                JTMB.setCodeGenOptLevel(Level);
+                return JTMB;
+            }
+
+            /// createDefinitionDylib - A JITDylib for one redefinable module. Its own
+            /// symbols come first, so calls within the module go straight to their
+            /// bodies, and everything else is found through the main JITDylib's stubs,
+            /// in the libraries or among the host symbols.
+            JITDylib& createDefinitionDylib(){
+                std::string Name = "<definition " + std::to_string(++NumDefinitionDylibs) + ">";
+                JITDylib& JD = ES->createBareJITDylib(std::move(Name));
+                JD.setLinkOrder(makeJITDylibSearchOrder({&MainJD, &LibraryJD, &HostJD}));
+                return JD;
+            }
+
+            /// discardDefinitionDylib - Remove the JITDylib of a module that failed to
+            /// compile, say for calling a function that doesn't exist, and return Err.
+            /// The old bodies stay current. Err may name JD, so it is turned into a
+            /// string before JD goes.
+            Error discardDefinitionDylib(JITDylib& JD, Error Err){
+                auto Message = make_error<StringError>(toString(std::move(Err)), inconvertibleErrorCode());
+                return joinErrors(std::move(Message), ES->removeJITDylib(JD));
+            }
+
+            /// redirectStubs - Point the stub of every function in Symbols at its body in
+            /// JD, creating the stubs of functions seen for the first time, and remove
+            /// the JITDylibs left with no current bodies.
+            Error redirectStubs(JITDylib& JD, const SymbolFlagsMap& Symbols){
+                SymbolMap Bodies;
+                if(CODLayer){
+                    // Until a body is compiled its stub points at a trampoline, which
+                    // compiles it on the first call and then repoints the stub.
+                    for(auto& KV : Symbols){
+                        if(!KV.second.isCallable())
+                            continue;
+                        SymbolStringPtr Name = KV.first;
+                        auto Trampoline = LCTM->getCallThroughTrampoline(
+                            JD, Name, [this, Name](JITTargetAddress Body){ return ISM->updatePointer(*Name, Body); });
+                        if(!Trampoline)
+                            return Trampoline.takeError();
+                        Bodies[Name] = JITEvaluatedSymbol(*Trampoline, KV.second);
+                    }
+                }else{
+                    SymbolLookupSet Callables;
+                    for(auto& KV : Symbols)
+                        if(KV.second.isCallable())
+                            Callables.add(KV.first);
+                    auto Compiled = ES->lookup(makeJITDylibSearchOrder(&JD), std::move(Callables));
+                    if(!Compiled)
+                        return discardDefinitionDylib(JD, Compiled.takeError());
+                    Bodies = std::move(*Compiled);
+                }
+
+                SymbolMap NewStubs;
+                for(auto& KV : Bodies){
+                    StringRef Name = *KV.first;
+                    if(ISM->findStub(Name, false)){
+                        if(auto Err = ISM->updatePointer(Name, KV.second.getAddress()))
+                            return Err;
+                    }else{
+                        if(auto Err = ISM->createStub(Name, KV.second.getAddress(), Symbols.lookup(KV.first)))
+                            return Err;
+                        NewStubs[KV.first] = ISM->findStub(Name, false);
+                    }
+                }
+                if(!NewStubs.empty())
+                    if(auto Err = MainJD.define(absoluteSymbols(std::move(NewStubs))))
+                        return Err;
+
+                for(auto& KV : Bodies){
+                    JITDylib*& Current = CurrentDefinitions[KV.first];
+                    if(Current && --NumCurrent[Current] == 0){
+                        NumCurrent.erase(Current);
+                        if(auto Err = ES->removeJITDylib(*Current))
+                            return Err;
+                    }
+                    Current = &JD;
+                    ++NumCurrent[&JD];
+                }
+                return Error::success();
+            }
+
+            /// handleLazyCallThroughError - Called from a stub whose function could not be compiled.
+            static void handleLazyCallThroughError(){
+                errs() << "LazyCallThrough error: Could not find function body";
+                exit(1);
+            }
+    };
+
+} // end of namespace orc
+} // end of namespace llvm
+
+#endif // KALEIDOSCOPEJIT_H
@@ -0,0 +1,370 @@
+// Precompiled Kaleidoscope libraries: bitcode plus an index of the functions in it
+
+#ifndef KALEIDOSCOPELIBRARY_H
+#define KALEIDOSCOPELIBRARY_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/Layer.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+namespace llvm{
+namespace orc{
+
+    /// A library file is laid out as
+    ///
+    ///     LibraryHeader
+    ///     LibrarySymbol[NumSymbols]       sorted by name
+    ///     char[StringTableSize]           each symbol's name, then its argument types
+    ///     padding to a multiple of 8
+    ///     char[BitcodeSize]               the module, as written by WriteBitcodeToFile
+    ///
+    /// Every field is little endian and every structure is naturally aligned at its
+    /// offset, so a library is used straight from a read-only mapping of the file.
+    struct LibraryHeader{
+        char Magic[4];
+        support::ulittle32_t Version;
+        support::ulittle32_t NumSymbols;
+        support::ulittle32_t StringTableSize;
+        support::ulittle64_t BitcodeOffset;
+        support::ulittle64_t BitcodeSize;
+    };
+
+    enum LibrarySymbolFlags : uint8_t {
+        libsym_readnone = 1 << 0,
+        libsym_nounwind = 1 << 1
+    };
+
+    /// LibrarySymbol - What the driver needs to know about a function of the library
+    /// without reading its bitcode: how to call it, and the hash of the source it was
+    /// compiled from.
+    struct LibrarySymbol{
+        support::ulittle32_t NameOffset;    // Into the string table.
+        support::ulittle32_t NameSize;
+        support::ulittle32_t NumArgs;
+        uint8_t Operator;                   // 0 unless a user defined operator.
+        uint8_t Precedence;                 // For binary operators.
+        uint8_t Flags;                      // LibrarySymbolFlags.
+        uint8_t ReturnType;                 // The driver's ValueType; those of the
+                                            // arguments follow the name, a byte each.
+        uint8_t SourceHash[16];
+    };
+
+    static_assert(sizeof(LibraryHeader) == 32 && sizeof(LibrarySymbol) == 32, "library structures are padded");
+
+    static constexpr char LibraryMagic[4] = {'K', 'L', 'I', 'B'};
+    static constexpr uint32_t LibraryVersion = 2;
+
+    /// LibraryEntry - One function to write into the index with writeLibrary.
+    struct LibraryEntry{
+        std::string Name;
+        uint32_t NumArgs;
+        uint8_t Operator;
+        uint8_t Precedence;
+        uint8_t Flags;
+        std::array<uint8_t, 16> SourceHash;
+        std::vector<uint8_t> ArgTypes;
+        uint8_t ReturnType;
+    };
+
+    /// writeLibrary - Write Bitcode, and an index of the Entries it defines, as a library.
+    inline void writeLibrary(raw_ostream& OS, std::vector<LibraryEntry> Entries, StringRef Bitcode){
+        llvm::sort(Entries, [](const LibraryEntry& L, const LibraryEntry& R){ return L.Name < R.Name; });
+
+        std::string Strings;
+        std::vector<LibrarySymbol> Index(Entries.size());
+        for(size_t I = 0, E = Entries.size(); I != E; ++I){
+            LibrarySymbol& Sym = Index[I];
+            std::memset(&Sym, 0, sizeof(Sym));
+            Sym.NameOffset = Strings.size();
+            Sym.NameSize = Entries[I].Name.size();
+            Sym.NumArgs = Entries[I].NumArgs;
+            Sym.Operator = Entries[I].Operator;
+            Sym.Precedence = Entries[I].Precedence;
+            Sym.Flags = Entries[I].Flags;
+            Sym.ReturnType = Entries[I].ReturnType;
+            std::copy(Entries[I].SourceHash.begin(), Entries[I].SourceHash.end(), Sym.SourceHash);
+            Strings += Entries[I].Name;
+            Strings.append(Entries[I].ArgTypes.begin(), Entries[I].ArgTypes.end());
+        }
+
+        uint64_t IndexEnd = sizeof(LibraryHeader) + Index.size() * sizeof(LibrarySymbol) + Strings.size();
+        uint64_t BitcodeOffset = alignTo(IndexEnd, 8);
+
+        LibraryHeader Header;
+        std::memcpy(Header.Magic, LibraryMagic, sizeof(Header.Magic));
+        Header.Version = LibraryVersion;
+        Header.NumSymbols = Index.size();
+        Header.StringTableSize = Strings.size();
+        Header.BitcodeOffset = BitcodeOffset;
+        Header.BitcodeSize = Bitcode.size();
+
+        OS.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+        OS.write(reinterpret_cast<const char*>(Index.data()), Index.size() * sizeof(LibrarySymbol));
+        OS << Strings;
+        OS.write_zeros(BitcodeOffset - IndexEnd);
+        OS << Bitcode;
+    }
+
+    /// KaleidoscopeLibrary - A library file opened for use. Opening one maps the
+    /// file and checks the index but reads none of the bitcode, so it costs the
+    /// same however big the library is.
+    class KaleidoscopeLibrary{
+        private:
+            std::unique_ptr<MemoryBuffer> Buffer;
+            ArrayRef<LibrarySymbol> Symbols;
+            StringRef Strings;
+            MemoryBufferRef Bitcode;
+
+            KaleidoscopeLibrary(std::unique_ptr<MemoryBuffer> Buffer) : Buffer(std::move(Buffer)) {}
+
+            static Error makeError(StringRef Path, const Twine& Msg){
+                return make_error<StringError>(Path + ": " + Msg, inconvertibleErrorCode());
+            }
+
+        public:
+            /// Open - Map the library at Path and check that its index is sound.
+            static Expected<std::unique_ptr<KaleidoscopeLibrary> > Open(StringRef Path){
+                auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+                if(!BufOrErr)
+                    return makeError(Path, BufOrErr.getError().message());
+                std::unique_ptr<KaleidoscopeLibrary> Lib(new KaleidoscopeLibrary(std::move(*BufOrErr)));
+
+                StringRef Data = Lib->Buffer->getBuffer();
+                if(Data.size() < sizeof(LibraryHeader) || std::memcmp(Data.data(), LibraryMagic, sizeof(LibraryMagic)))
+                    return makeError(Path, "not a Kaleidoscope library");
+                const auto* Header = reinterpret_cast<const LibraryHeader*>(Data.data());
+                if(Header->Version != LibraryVersion)
+                    return makeError(Path, "unsupported library version " + Twine(uint32_t(Header->Version)));
+
+                uint64_t IndexSize = uint64_t(Header->NumSymbols) * sizeof(LibrarySymbol);
+                uint64_t StringsOffset = sizeof(LibraryHeader) + IndexSize;
+                if(StringsOffset + Header->StringTableSize > Header->BitcodeOffset ||
+                   Header->BitcodeOffset > Data.size() || Header->BitcodeSize > Data.size() - Header->BitcodeOffset)
+                    return makeError(Path, "truncated library");
+
+                Lib->Symbols = makeArrayRef(reinterpret_cast<const LibrarySymbol*>(Data.data() + sizeof(LibraryHeader)),
+                                            Header->NumSymbols);
+                Lib->Strings = Data.substr(StringsOffset, Header->StringTableSize);
+                Lib->Bitcode = MemoryBufferRef(Data.substr(Header->BitcodeOffset, Header->BitcodeSize),
+                                               Lib->Buffer->getBufferIdentifier());
+                for(const LibrarySymbol& Sym : Lib->Symbols)
+                    if(uint64_t(Sym.NameOffset) + Sym.NameSize + Sym.NumArgs > Lib->Strings.size())
+                        return makeError(Path, "symbol name out of range");
+                return Lib;
+            }
+
+            StringRef getPath() const {return Buffer->getBufferIdentifier();}
+            ArrayRef<LibrarySymbol> symbols() const {return Symbols;}
+            MemoryBufferRef getBitcode() const {return Bitcode;}
+
+            StringRef getName(const LibrarySymbol& Sym) const{
+                return Strings.substr(Sym.NameOffset, Sym.NameSize);
+            }
+
+            /// getArgTypes - The type of each argument of Sym, as the driver's ValueType.
+            ArrayRef<uint8_t> getArgTypes(const LibrarySymbol& Sym) const{
+                return arrayRefFromStringRef(Strings.substr(Sym.NameOffset + Sym.NameSize, Sym.NumArgs));
+            }
+
+            /// find - The index entry for Name, or null. The index is sorted, so this
+            /// is a binary search over the mapped file.
+            const LibrarySymbol* find(StringRef Name) const{
+                auto I = std::lower_bound(Symbols.begin(), Symbols.end(), Name,
+                                          [this](const LibrarySymbol& Sym, StringRef N){ return getName(Sym) < N; });
+                if(I == Symbols.end() || getName(*I) != Name)
+                    return nullptr;
+                return &*I;
+            }
+    };
+
+    /// LibraryGenerator - Defines functions of a library in a JITDylib when they are
+    /// first looked up. The library's bitcode is only opened by the first lookup,
+    /// as a lazily materialized module, and each lookup then reads just the bodies
+    /// of the functions it asks for and clones them into a module of their own for
+    /// Layer, in BodiesJD. Each body is named NAME.lib, and NAME is a stub in ISM
+    /// that compiles the body on its first call, so it can be redefined like any
+    /// other function. Calls to other functions, those of the same library
+    /// included, become declarations that resolve to their stubs.
+    class LibraryGenerator : public DefinitionGenerator{
+        private:
+            /// DeclarationMaterializer - Maps every function a cloned body refers to onto
+            /// a declaration of the same name in the new module. Internal functions and
+            /// globals, such as the caches of -memoize, can't be reached from another
+            /// module, so they get a copy of their own instead; their bodies and
+            /// initializers are left in Pending for the caller to clone.
+            class DeclarationMaterializer : public ValueMaterializer{
+                private:
+                    Module& Dest;
+
+                public:
+                    SmallVector<std::pair<GlobalValue*, GlobalValue*>, 4> Pending;
+
+                    explicit DeclarationMaterializer(Module& Dest) : Dest(Dest) {}
+
+                    Value* materialize(Value* V) override{
+                        auto* GV = dyn_cast<GlobalValue>(V);
+                        if(!GV)
+                            return nullptr;
+                        if(GlobalValue* Existing = Dest.getNamedValue(GV->getName()))
+                            return Existing;
+
+                        GlobalValue::LinkageTypes Linkage =
+                            GV->hasLocalLinkage() ? GV->getLinkage() : GlobalValue::ExternalLinkage;
+                        GlobalValue* Copy;
+                        if(auto* F = dyn_cast<Function>(GV)){
+                            Function* NewF = Function::Create(F->getFunctionType(), Linkage, F->getName(), Dest);
+                            NewF->copyAttributesFrom(F);
+                            Copy = NewF;
+                        }else if(auto* G = dyn_cast<GlobalVariable>(GV)){
+                            auto* NewG = new GlobalVariable(Dest, G->getValueType(), G->isConstant(), Linkage,
+                                                            nullptr, G->getName());
+                            NewG->copyAttributesFrom(G);
+                            Copy = NewG;
+                        }else
+                            return nullptr;
+
+                        if(GV->hasLocalLinkage())
+                            Pending.push_back({GV, Copy});
+                        return Copy;
+                    }
+            };
+
+            /// cloneInto - Give NewF the body of F, which is materialized.
+            static void cloneInto(Function* NewF, Function* F, ValueToValueMapTy& VMap,
+                                  DeclarationMaterializer& Materializer){
+                auto NewArg = NewF->arg_begin();
+                for(Argument& Arg : F->args())
+                    VMap[&Arg] = &*NewArg++;
+
+                SmallVector<ReturnInst*, 4> Returns;
+                CloneFunctionInto(NewF, F, VMap, CloneFunctionChangeType::DifferentModule, Returns, "", nullptr,
+                                  nullptr, &Materializer);
+            }
+
+            IRLayer& Layer;
+            LazyCallThroughManager& LCTM;
+            IndirectStubsManager& ISM;
+            JITDylib& BodiesJD;
+            std::unique_ptr<KaleidoscopeLibrary> Lib;
+            char GlobalPrefix;
+
+            ThreadSafeContext TSCtx;
+            std::unique_ptr<Module> LazyModule; // Created by the first lookup, under TSCtx's lock.
+
+        public:
+            LibraryGenerator(IRLayer& Layer, LazyCallThroughManager& LCTM, IndirectStubsManager& ISM,
+                             JITDylib& BodiesJD, std::unique_ptr<KaleidoscopeLibrary> Lib, char GlobalPrefix)
+                : Layer(Layer), LCTM(LCTM), ISM(ISM), BodiesJD(BodiesJD), Lib(std::move(Lib)),
+                  GlobalPrefix(GlobalPrefix), TSCtx(std::make_unique<LLVMContext>()) {}
+
+            Error tryToGenerate(LookupState& /*LS*/, LookupKind /*K*/, JITDylib& JD,
+                                JITDylibLookupFlags /*JDLookupFlags*/, const SymbolLookupSet& LookupSet) override{
+                SmallVector<std::pair<StringRef, SymbolStringPtr>, 8> Names;
+                for(auto& KV : LookupSet){
+                    StringRef Name = *KV.first;
+                    if(GlobalPrefix && !Name.consume_front(StringRef(&GlobalPrefix, 1)))
+                        continue;
+                    if(Lib->find(Name))
+                        Names.push_back({Name, KV.first});
+                }
+                if(Names.empty())
+                    return Error::success();
+
+                std::unique_ptr<Module> M;
+                SymbolAliasMap Stubs;
+                {
+                    auto Lock = TSCtx.getLock();
+                    if(!LazyModule){
+                        auto LazyOrErr = getLazyBitcodeModule(Lib->getBitcode(), *TSCtx.getContext());
+                        if(!LazyOrErr)
+                            return LazyOrErr.takeError();
+                        LazyModule = std::move(*LazyOrErr);
+                    }
+
+                    M = std::make_unique<Module>(Lib->getPath(), *TSCtx.getContext());
+                    M->setDataLayout(LazyModule->getDataLayout());
+                    M->setTargetTriple(LazyModule->getTargetTriple());
+
+                    // Calls among the functions asked for go through their stubs like
+                    // any others, only a function's calls to itself bind to its body.
+                    ExecutionSession& ES = JD.getExecutionSession();
+                    ValueToValueMapTy VMap;
+                    DeclarationMaterializer Materializer(*M);
+                    for(auto& Name : Names){
+                        Function* F = LazyModule->getFunction(Name.first);
+                        if(!F || F->isDeclaration())
+                            continue;
+                        if(Error Err = F->materialize())
+                            return Err;
+
+                        std::string BodyName = (Name.first + ".lib").str();
+                        Function* NewF = Function::Create(F->getFunctionType(), GlobalValue::ExternalLinkage,
+                                                          BodyName, *M);
+                        VMap[F] = NewF;
+                        cloneInto(NewF, F, VMap, Materializer);
+                        VMap.erase(F);
+                        Stubs[Name.second] = SymbolAliasMapEntry(
+                            ES.intern(GlobalPrefix ? GlobalPrefix + BodyName : BodyName),
+                            JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+
+                        // Each function is generated once, its body isn't needed again.
+                        F->deleteBody();
+                    }
+
+                    // Internal helpers may be shared, so their bodies stay behind.
+                    while(!Materializer.Pending.empty()){
+                        auto Copy = Materializer.Pending.pop_back_val();
+                        if(auto* F = dyn_cast<Function>(Copy.first)){
+                            if(F->isDeclaration())
+                                continue;
+                            if(Error Err = F->materialize())
+                                return Err;
+                            cloneInto(cast<Function>(Copy.second), F, VMap, Materializer);
+                        }else{
+                            auto* G = cast<GlobalVariable>(Copy.first);
+                            if(G->hasInitializer())
+                                cast<GlobalVariable>(Copy.second)->setInitializer(
+                                    MapValue(G->getInitializer(), VMap, RF_None, nullptr, &Materializer));
+                        }
+                    }
+
+                    if(Stubs.empty())
+                        return Error::success();
+                }
+
+                if(Error Err = Layer.add(BodiesJD, ThreadSafeModule(std::move(M), TSCtx)))
+                    return Err;
+                return JD.define(lazyReexports(LCTM, ISM, BodiesJD, std::move(Stubs)));
+            }
+    };
+
+} // end of namespace orc
+} // end of namespace llvm
+
+#endif // KALEIDOSCOPELIBRARY_H
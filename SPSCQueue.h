@@ -0,0 +1,83 @@
+// Bounded single producer, single consumer queue for handing work from one thread to another
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+/// SPSCQueue - A fixed size ring of T for exactly one thread pushing and one other
+/// thread popping. Neither side takes a lock: each one owns an index and only reads
+/// the other's, and the release store of an index publishes the slot it covers.
+///
+/// A push into a full queue or a pop from an empty one waits for the other side,
+/// yielding for a while and then sleeping in short steps, so a side that is far
+/// ahead doesn't keep a core busy.
+///
+/// The two indices sit on cache lines of their own, and each side keeps a copy of
+/// the other's index that it only refreshes when the queue looks full or empty, so
+/// in the steady state the threads don't share a cache line.
+template<typename T>
+class SPSCQueue{
+    private:
+        static constexpr size_t CacheLineSize = 64;
+        static constexpr unsigned SpinsBeforeSleeping = 64;
+
+        const size_t Capacity;
+        std::unique_ptr<T[]> Slots;
+
+        // Indices only ever grow; slot I % Capacity holds item I.
+        alignas(CacheLineSize) std::atomic<size_t> Head{0};   // Next item to pop, written by the consumer.
+        size_t CachedTail = 0;                                // The consumer's copy of Tail.
+
+        alignas(CacheLineSize) std::atomic<size_t> Tail{0};   // Next item to push, written by the producer.
+        size_t CachedHead = 0;                                // The producer's copy of Head.
+
+        static void backOff(unsigned& Spins){
+            if(++Spins < SpinsBeforeSleeping)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+
+    public:
+        explicit SPSCQueue(size_t Capacity) : Capacity(Capacity ? Capacity : 1), Slots(new T[this->Capacity]) {}
+
+        SPSCQueue(const SPSCQueue&) = delete;
+        SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+        /// push - Append V, waiting for room if the queue is full. Producer only.
+        void push(T V){
+            size_t Idx = Tail.load(std::memory_order_relaxed);
+            unsigned Spins = 0;
+            while(Idx - CachedHead == Capacity){
+                CachedHead = Head.load(std::memory_order_acquire);
+                if(Idx - CachedHead == Capacity)
+                    backOff(Spins);
+            }
+
+            Slots[Idx % Capacity] = std::move(V);
+            Tail.store(Idx + 1, std::memory_order_release);
+        }
+
+        /// pop - Take the oldest item, waiting for one if the queue is empty. Consumer only.
+        T pop(){
+            size_t Idx = Head.load(std::memory_order_relaxed);
+            unsigned Spins = 0;
+            while(Idx == CachedTail){
+                CachedTail = Tail.load(std::memory_order_acquire);
+                if(Idx == CachedTail)
+                    backOff(Spins);
+            }
+
+            T V = std::move(Slots[Idx % Capacity]);
+            Head.store(Idx + 1, std::memory_order_release);
+            return V;
+        }
+};
+
+#endif // SPSCQUEUE_H
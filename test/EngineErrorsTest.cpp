@@ -0,0 +1,48 @@
+// Host-side check that KaleidoscopeEngine reports JIT errors instead of exiting.
+//
+// Build it with Kaleidoscope.cpp compiled with -DKALEIDOSCOPE_NO_MAIN, -I pointing
+// at the repository and LLVM's cxxflags and libraries, as for the driver.
+// The program exits with 0 if every check passes.
+
+#include "KaleidoscopeEngine.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static int Failures = 0;
+
+static void check(bool Condition, const char* What){
+    if(!Condition){
+        std::printf("FAILED: %s\n", What);
+        ++Failures;
+    }
+}
+
+int main(){
+    std::string Error;
+    auto Engine = KaleidoscopeEngine::create(&Error);
+    if(!Engine){
+        std::printf("FAILED: create: %s\n", Error.c_str());
+        return 1;
+    }
+
+    // A definition calling an extern nothing defines can't be compiled, and the
+    // call to it can't either. Neither may end the process.
+    std::vector<double> Results;
+    bool Compiled = Engine->compile("extern nosuch(x); def g(x) nosuch(x); g(1);", &Results, &Error);
+    check(!Compiled, "compile with an unresolved extern returns false");
+    check(Results.empty(), "the failed expression has no result");
+    check(Error.find("nosuch") != std::string::npos, "the error names the missing symbol");
+    check(Engine->lookup<double(double)>("g") == nullptr, "the failed definition can't be looked up");
+
+    // The engine carries on, and a failed redefinition keeps the old body.
+    Results.clear();
+    check(Engine->compile("def h(x) x + 1; h(2);", &Results, &Error), "a good compile afterwards succeeds");
+    check(Results.size() == 1 && Results[0] == 3, "h(2) is 3");
+    check(!Engine->compile("def h(x) nosuch(x);", nullptr, &Error), "a failed redefinition returns false");
+    auto* H = Engine->lookup<double(double)>("h", &Error);
+    check(H && H(4) == 5, "h keeps its old body");
+
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Check that redefining a library function replaces it for the library's own
+# code too, whether or not that code has run yet, and with either JIT, and that
+# entering a library function's own source again keeps the library's code.
+#
+# Usage: LibraryRedefinitionTest.sh path/to/kaleidoscope
+# Exits with 0 if every check passes.
+
+KALEIDOSCOPE=${1:?usage: $0 path/to/kaleidoscope}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+FAILURES=0
+
+# values FILE [OPTIONS...] - The values the top-level expressions of FILE print.
+values(){
+    FILE=$1
+    shift
+    "$KALEIDOSCOPE" "$@" -l "$DIR/quad.klib" "$FILE" 2>&1 </dev/null | sed -n 's/.*Evaluated to //p' | tr '\n' ' '
+}
+
+check(){
+    if [ "$2" != "$3" ]; then
+        echo "FAILED: $1: got '$2', expected '$3'"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+cat > "$DIR/quad.ks" <<'KS'
+def sq(x) x*x;
+def quad(x) sq(sq(x));
+def cnt(n) if n < 1 then 0 else 1 + cnt(n-1);
+KS
+"$KALEIDOSCOPE" -c -filetype=lib -o "$DIR/quad.klib" "$DIR/quad.ks" >/dev/null || exit 1
+
+# Redefined before the library code first runs.
+printf 'def sq(x) x+x;\nquad(2);\n' > "$DIR/before.ks"
+# Redefined after it has run, so it is already compiled.
+printf 'quad(2);\ndef sq(x) x+x;\nquad(2);\n' > "$DIR/after.ks"
+# The library's own source again: its code is kept, calls to itself and all.
+printf 'def sq(x) x*x;\nquad(2);\n' > "$DIR/same.ks"
+printf 'def cnt(n) if n < 1 then 0 else 1 + cnt(n-1);\ncnt(5);\n' > "$DIR/recursive.ks"
+
+for JIT in -lazy=true -lazy=false; do
+    check "redefined before the first call ($JIT)" "$(values "$DIR/before.ks" $JIT)" "8 "
+    check "redefined after the first call ($JIT)" "$(values "$DIR/after.ks" $JIT)" "16 8 "
+    check "the library's own definition ($JIT)" "$(values "$DIR/same.ks" $JIT)" "16 "
+    check "a recursive library function's own definition ($JIT)" "$(values "$DIR/recursive.ks" $JIT)" "5 "
+done
+
+KEPT=$("$KALEIDOSCOPE" -l "$DIR/quad.klib" "$DIR/same.ks" "$DIR/recursive.ks" 2>&1 </dev/null | grep -c "from a library")
+check "library code kept for its own source" "$KEPT" "2"
+
+exit $((FAILURES != 0))
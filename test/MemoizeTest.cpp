@@ -0,0 +1,58 @@
+// Host-side check that -memoize never hands out a result computed with a
+// definition that has since been replaced.
+//
+// Build it with Kaleidoscope.cpp compiled with -DKALEIDOSCOPE_NO_MAIN, -I pointing
+// at the repository and LLVM's cxxflags and libraries, as for the driver.
+// The program exits with 0 if every check passes.
+
+#include "KaleidoscopeEngine.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static int Failures = 0;
+
+static void check(bool Condition, const char* What){
+    if(!Condition){
+        std::printf("FAILED: %s\n", What);
+        ++Failures;
+    }
+}
+
+int main(){
+    // The engine is configured through the driver's options.
+    const char* Args[] = {"MemoizeTest", "-memoize"};
+    llvm::cl::ParseCommandLineOptions(2, Args);
+
+    std::string Error;
+    auto Engine = KaleidoscopeEngine::create(&Error);
+    if(!Engine){
+        std::printf("FAILED: create: %s\n", Error.c_str());
+        return 1;
+    }
+
+    std::vector<double> Results;
+    check(Engine->compile("def f(x) x * 2; def g(x) f(x) + 1; g(3); g(3);", &Results, &Error),
+          "the first definitions compile");
+    check(Results.size() == 2 && Results[0] == 7 && Results[1] == 7, "g(3) is 7, twice");
+
+    auto* G = Engine->lookup<double(double)>("g", &Error);
+    check(G && G(3) == 7, "a call of g caches 7 for 3");
+
+    // g isn't redefined, but what it calls is: its cache and the results of
+    // top-level expressions must not be used any more.
+    Results.clear();
+    check(Engine->compile("def f(x) x * 3; g(3);", &Results, &Error), "redefining f compiles");
+    check(Results.size() == 1 && Results[0] == 10, "the expression g(3) sees the new f");
+    check(G(3) == 10, "a call of g sees the new f");
+    check(G(3) == 10, "and caches the new result");
+
+    // Back to the old definition: results from the first one aren't revived.
+    Results.clear();
+    check(Engine->compile("def f(x) x * 2; g(3);", &Results, &Error), "redefining f again compiles");
+    check(Results.size() == 1 && Results[0] == 7, "g(3) is 7 again");
+
+    return Failures ? 1 : 0;
+}